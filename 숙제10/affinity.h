@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using CpuList = std::vector<unsigned>;
+
+// Parses a cpu list like "0-3,8". Anything unreadable is skipped.
+inline CpuList parse_cpu_list(const std::string &text) {
+    CpuList cpus;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        auto end = text.find(',', pos);
+        if (end == std::string::npos)
+            end = text.size();
+        auto range = text.substr(pos, end - pos);
+        pos = end + 1;
+
+        try {
+            auto dash = range.find('-');
+            unsigned first = std::stoul(range.substr(0, dash));
+            unsigned last = dash == std::string::npos
+                                ? first
+                                : std::stoul(range.substr(dash + 1));
+            for (auto cpu = first; cpu <= last; ++cpu)
+                cpus.emplace_back(cpu);
+        } catch (const std::exception &) {
+        }
+    }
+    return cpus;
+}
+
+// Picks the set of the n-th thread of a role, cycling when the config lists
+// fewer sets than there are threads.
+inline CpuList cpus_of(const std::vector<CpuList> &sets, unsigned n) {
+    if (sets.empty())
+        return {};
+    return sets[n % sets.size()];
+}
+
+// Pins the calling thread to `cpus`. An empty list leaves it unpinned.
+// Memory the thread touches first afterwards comes from its own NUMA node.
+inline bool pin_this_thread(const CpuList &cpus) {
+    if (cpus.empty())
+        return true;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus)
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,110 @@
+#include "../entity_table.h"
+#include "../protocol.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+// Proximity scan over the client slots as the server did it before the
+// entity table: one slot per index, each pointing at a heap allocated
+// client whose position sits among its other fields.
+struct OldClient {
+    unsigned id;
+    bool is_logged_in;
+    short x, y;
+    // Pads the client to the size of SOCKETINFO.
+    char rest[288 - 12];
+};
+
+struct OldSlot {
+    atomic_bool is_active{false};
+    unique_ptr<OldClient> ptr;
+};
+
+constexpr short VIEW_RANGE = 7;
+
+static bool is_near(int x1, int y1, int x2, int y2) {
+    return abs(x1 - x2) <= VIEW_RANGE && abs(y1 - y2) <= VIEW_RANGE;
+}
+
+static void old_find_near(const vector<OldSlot> &slots, short x, short y,
+                          vector<unsigned> &out) {
+    for (auto &slot : slots) {
+        if (!slot.is_active.load(memory_order_acquire))
+            continue;
+        auto &cl = *slot.ptr;
+        if (cl.is_logged_in && is_near(cl.x, cl.y, x, y))
+            out.emplace_back(cl.id);
+    }
+}
+
+template <typename F> static double time_queries(unsigned queries, F &&f) {
+    auto start = chrono::steady_clock::now();
+    for (unsigned i = 0; i < queries; ++i)
+        f(i);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// entity_scan_bench [entities] [queries]
+int main(int argc, char *argv[]) {
+    const unsigned count = argc > 1 ? atoi(argv[1]) : 20000;
+    const unsigned queries = argc > 2 ? atoi(argv[2]) : 20000;
+
+    mt19937 rng{7};
+    vector<OldSlot> slots(count);
+    EntityTable table{count};
+    // Something else lives between the clients on the heap of a server.
+    vector<unique_ptr<char[]>> filler;
+    for (unsigned i = 0; i < count; ++i) {
+        const short x = rng() % WORLD_WIDTH, y = rng() % WORLD_HEIGHT;
+        const bool is_logged_in = rng() % 16 != 0;
+
+        slots[i].ptr.reset(new OldClient{i, is_logged_in, x, y, {}});
+        slots[i].is_active.store(true, memory_order_relaxed);
+        filler.emplace_back(new char[64 + rng() % 512]);
+
+        table.set_id(i, i);
+        table.set_position(i, x, y);
+        table.set_flags(i,
+                        ENTITY_ACTIVE | (is_logged_in ? ENTITY_LOGGED_IN : 0));
+    }
+
+    vector<pair<short, short>> points(queries);
+    for (auto &point : points)
+        point = {short(rng() % WORLD_WIDTH), short(rng() % WORLD_HEIGHT)};
+
+    vector<unsigned> near_ids;
+    size_t old_found = 0, new_found = 0;
+    const double old_s = time_queries(queries, [&](unsigned i) {
+        near_ids.clear();
+        old_find_near(slots, points[i].first, points[i].second, near_ids);
+        old_found += near_ids.size();
+    });
+    const double new_s = time_queries(queries, [&](unsigned i) {
+        near_ids.clear();
+        table.query_near(points[i].first, points[i].second, VIEW_RANGE,
+                         ENTITY_ACTIVE | ENTITY_LOGGED_IN, count, near_ids);
+        new_found += near_ids.size();
+    });
+
+    if (old_found != new_found) {
+        fprintf(stderr, "scans disagree: %zu and %zu ids\n", old_found,
+                new_found);
+        return 1;
+    }
+
+    const double scanned = double(count) * queries;
+    printf("%u entities, %u queries, %zu ids found\n", count, queries,
+           new_found);
+    printf("slots  %8.1f us/query %8.1f M entities/s\n", old_s * 1e6 / queries,
+           scanned / old_s / 1e6);
+    printf("table  %8.1f us/query %8.1f M entities/s\n", new_s * 1e6 / queries,
+           scanned / new_s / 1e6);
+    printf("speedup %.1fx\n", old_s / new_s);
+}
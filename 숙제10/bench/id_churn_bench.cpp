@@ -0,0 +1,96 @@
+#include "../entity_table.h"
+#include "../id_allocator.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+constexpr unsigned CAPACITY = 1 << 20;
+
+// Every thread keeps `live` clients connected and replaces a random one
+// `cycles` times, like logins and logouts through the front end.
+static void churn(IdAllocator &ids, unsigned live, unsigned cycles,
+                  unsigned seed) {
+    mt19937 rng{seed};
+    vector<unsigned> connected;
+    for (unsigned i = 0; i < live; ++i)
+        connected.emplace_back(*ids.allocate());
+    for (unsigned i = 0; i < cycles; ++i) {
+        auto &id = connected[rng() % live];
+        ids.release(id);
+        id = *ids.allocate();
+    }
+    for (auto id : connected)
+        ids.release(id);
+}
+
+// Time of one view range scan up to `bound`, what every move pays.
+static double scan_us(const EntityTable &table, unsigned bound) {
+    constexpr unsigned QUERIES = 2000;
+    vector<unsigned> near_ids;
+    auto start = chrono::steady_clock::now();
+    for (unsigned i = 0; i < QUERIES; ++i) {
+        near_ids.clear();
+        table.query_near(i % 400, i % 800, 7, ENTITY_ACTIVE, bound, near_ids);
+    }
+    chrono::duration<double, micro> elapsed =
+        chrono::steady_clock::now() - start;
+    return elapsed.count() / QUERIES;
+}
+
+// id_churn_bench [cycles] [live] [threads]
+int main(int argc, char *argv[]) {
+    const unsigned cycles = argc > 1 ? atoi(argv[1]) : 1000000;
+    const unsigned live = argc > 2 ? atoi(argv[2]) : 1000;
+    const unsigned thread_num = argc > 3 ? atoi(argv[3]) : 1;
+
+    IdAllocator ids{CAPACITY};
+    // Peak of the bound, sampled while the threads churn.
+    unsigned peak_bound = 0;
+    atomic_bool is_done{false};
+    thread sampler{[&] {
+        while (!is_done.load(memory_order_relaxed))
+            peak_bound = max(peak_bound, ids.bound());
+    }};
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (unsigned t = 0; t < thread_num; ++t)
+        threads.emplace_back(churn, ref(ids), live, cycles / thread_num, t);
+    for (auto &t : threads)
+        t.join();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    is_done.store(true);
+    sampler.join();
+
+    if (ids.live() != 0 || ids.bound() != 0) {
+        fprintf(stderr, "leaked ids: live %u bound %u\n", ids.live(),
+                ids.bound());
+        return 1;
+    }
+
+    const unsigned total = cycles / thread_num * thread_num;
+    // Ids that only count up end past every id handed out so far.
+    const unsigned counter_bound = min(total + live * thread_num, CAPACITY);
+    EntityTable table{CAPACITY};
+    // Off the map, so the scans only pay for reading the table.
+    for (unsigned i = 0; i < CAPACITY; ++i) {
+        table.set_position(i, -100, -100);
+        table.set_flags(i, ENTITY_ACTIVE);
+    }
+
+    printf("%u connects and disconnects, %u live per thread, %u threads\n",
+           total, live, thread_num);
+    printf("allocator  %6.1f ns per connect and disconnect\n",
+           elapsed.count() * 1e9 / total);
+    printf("bound      recycled %7u  counter %7u\n", peak_bound,
+           counter_bound);
+    printf("scan       recycled %7.1f us  counter %7.1f us\n",
+           scan_us(table, peak_bound), scan_us(table, counter_bound));
+}
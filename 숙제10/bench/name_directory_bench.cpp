@@ -0,0 +1,121 @@
+#include "../name_directory.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// The same claims behind one lock, what the directory would be without
+// its lock free probes.
+class LockedNames {
+  public:
+    optional<NameHolder> claim(string_view name, unsigned id,
+                               unsigned server_id) {
+        lock_guard<mutex> lg{lock};
+        auto [it, is_new] =
+            holders.try_emplace(string{name}, NameHolder{id, server_id});
+        if (!is_new && it->second.id != id)
+            return it->second;
+        return nullopt;
+    }
+    bool release(string_view name, unsigned id) {
+        lock_guard<mutex> lg{lock};
+        auto it = holders.find(string{name});
+        if (it == holders.end() || it->second.id != id)
+            return false;
+        holders.erase(it);
+        return true;
+    }
+
+  private:
+    unordered_map<string, NameHolder> holders;
+    mutex lock;
+};
+
+struct Result {
+    double seconds;
+    unsigned long long rejects;
+    unsigned long long lost;
+};
+
+// Every thread holds a few names the whole time, like players that stay
+// logged in. Each login claims a name of its own thread, tries one the
+// next thread holds, as a player already logged in elsewhere would, and
+// logs out again.
+template <typename Directory>
+static Result run(Directory &names, unsigned thread_num, unsigned logins) {
+    constexpr unsigned NAMES = 64;
+    vector<vector<string>> held(thread_num), churned(thread_num);
+    for (unsigned t = 0; t < thread_num; ++t) {
+        for (unsigned i = 0; i < NAMES; ++i) {
+            held[t].emplace_back("held" + to_string(t) + "_" + to_string(i));
+            churned[t].emplace_back("player" + to_string(t) + "_" +
+                                    to_string(i));
+            names.claim(held[t].back(), -1 - t, 0);
+        }
+    }
+
+    atomic_ullong rejects{0}, lost{0};
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (unsigned t = 0; t < thread_num; ++t) {
+        threads.emplace_back([&, t] {
+            const auto &own = churned[t];
+            const auto &other = held[(t + 1) % thread_num];
+            unsigned long long thread_rejects = 0, thread_lost = 0;
+            for (unsigned i = 0; i < logins; ++i) {
+                const unsigned id = t * logins + i;
+                const auto &name = own[i % NAMES];
+                if (names.claim(name, id, 0))
+                    ++thread_lost;
+                if (names.claim(other[i % NAMES], id, 0))
+                    ++thread_rejects;
+                names.release(name, id);
+            }
+            rejects += thread_rejects;
+            lost += thread_lost;
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return Result{elapsed.count(), rejects, lost};
+}
+
+static void print(const char *label, const Result &result, unsigned logins) {
+    printf("%-9s %7.1f ns per login  %6.2f M logins/s\n", label,
+           result.seconds * 1e9 / logins, logins / result.seconds / 1e6);
+}
+
+// name_directory_bench [threads] [logins per thread]
+int main(int argc, char *argv[]) {
+    const unsigned thread_num = argc > 1 ? atoi(argv[1]) : 16;
+    const unsigned logins = argc > 2 ? atoi(argv[2]) : 200000;
+
+    NameDirectory directory{1 << 18};
+    LockedNames locked;
+    auto directory_result = run(directory, thread_num, logins);
+    auto locked_result = run(locked, thread_num, logins);
+
+    const unsigned total = thread_num * logins;
+    for (auto &result : {directory_result, locked_result}) {
+        if (result.lost != 0 || result.rejects != total) {
+            fprintf(stderr, "%llu own names taken, %llu of %u held names "
+                            "rejected\n",
+                    result.lost, result.rejects, total);
+            return 1;
+        }
+    }
+
+    printf("%u threads, %u logins on %u cores\n", thread_num, total,
+           thread::hardware_concurrency());
+    print("directory", directory_result, total);
+    print("locked", locked_result, total);
+}
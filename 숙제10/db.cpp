@@ -0,0 +1,184 @@
+#include "db.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// write() may take only part of the buffer, the rest is written after it.
+static bool write_all(int fd, const void *data, size_t size) {
+    auto p = static_cast<const char *>(data);
+    while (size > 0) {
+        auto written = write(fd, p, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+
+int64_t record_time() {
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+PlayerDB::PlayerDB(const string &path, chrono::milliseconds commit_interval)
+    : path{path}, commit_interval{commit_interval} {
+    load_log();
+    compact();
+    if (fd < 0 && !open_log())
+        throw runtime_error("Can't open player db : " + path);
+
+    flusher = thread{[this]() { do_flusher(); }};
+}
+
+PlayerDB::~PlayerDB() {
+    is_running.store(false, memory_order_release);
+    if (flusher.joinable())
+        flusher.join();
+    if (fd >= 0)
+        close(fd);
+}
+
+optional<PlayerRecord> PlayerDB::load(const string &name) {
+    shared_lock<shared_mutex> lg{index_lock};
+    auto it = index.find(name);
+    if (it == index.end())
+        return nullopt;
+    return it->second;
+}
+
+void PlayerDB::save(const PlayerRecord &record) {
+    {
+        unique_lock<shared_mutex> lg{index_lock};
+        index[string{record.name, strnlen(record.name, MAX_ID_LEN)}] = record;
+    }
+    write_queue.enq(record);
+}
+
+void PlayerDB::restore(const PlayerRecord &record) {
+    {
+        unique_lock<shared_mutex> lg{index_lock};
+        auto &saved =
+            index[string{record.name, strnlen(record.name, MAX_ID_LEN)}];
+        if (saved.saved_at > record.saved_at)
+            return;
+        saved = record;
+    }
+    write_queue.enq(record);
+}
+
+void PlayerDB::load_log() {
+    int in = open(path.c_str(), O_RDONLY);
+    if (in < 0)
+        return;
+
+    PlayerRecord record;
+    while (read(in, &record, sizeof(record)) == sizeof(record)) {
+        index[string{record.name, strnlen(record.name, MAX_ID_LEN)}] = record;
+        ++log_records;
+    }
+    close(in);
+}
+
+// Drops a torn record a crash may have left at the end, records appended
+// after it would be read out of line.
+bool PlayerDB::open_log() {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+    is_torn = ftruncate(fd, log_records * sizeof(PlayerRecord)) != 0;
+    return true;
+}
+
+// Records saved while this runs are either in the copy of the index or
+// still queued, and the queue is appended to the new log.
+void PlayerDB::compact() {
+    vector<PlayerRecord> records;
+    {
+        shared_lock<shared_mutex> lg{index_lock};
+        if (index.empty())
+            return;
+        records.reserve(index.size());
+        for (auto &[_, record] : index)
+            records.emplace_back(record);
+    }
+
+    const string tmp_path = path + ".tmp";
+    int out = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        cerr << "Can't compact player db : " << tmp_path << endl;
+        return;
+    }
+    bool ok = write_all(out, records.data(),
+                        records.size() * sizeof(PlayerRecord)) &&
+              fdatasync(out) == 0;
+    close(out);
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        cerr << "Can't compact player db : " << strerror(errno) << endl;
+        return;
+    }
+
+    if (fd >= 0)
+        close(fd);
+    log_records = records.size();
+    if (!open_log())
+        cerr << "Can't open player db : " << strerror(errno) << endl;
+}
+
+void PlayerDB::do_flusher() {
+    while (is_running.load(memory_order_acquire)) {
+        this_thread::sleep_for(commit_interval);
+        flush();
+    }
+    flush();
+}
+
+// A batch that fails to go in whole is cut back to the last whole record
+// and tried again with the next one, ahead of the records queued since.
+void PlayerDB::flush() {
+    const auto size = write_queue.size();
+    for (size_t i = 0; i < size; ++i)
+        batch.emplace_back(*write_queue.deq());
+    if (batch.empty())
+        return;
+
+    if (!append(batch))
+        return;
+    batch.clear();
+
+    size_t players;
+    {
+        shared_lock<shared_mutex> lg{index_lock};
+        players = index.size();
+    }
+    if (log_records >= MIN_COMPACT_RECORDS && log_records >= 2 * players)
+        compact();
+}
+
+bool PlayerDB::append(const vector<PlayerRecord> &records) {
+    if (fd < 0 && !open_log())
+        return false;
+    if (is_torn) {
+        if (ftruncate(fd, log_records * sizeof(PlayerRecord)) != 0)
+            return false;
+        is_torn = false;
+    }
+    if (!write_all(fd, records.data(), records.size() * sizeof(PlayerRecord)) ||
+        fdatasync(fd) != 0) {
+        cerr << "Error at write to player db : " << strerror(errno) << endl;
+        is_torn = true;
+        return false;
+    }
+    log_records += records.size();
+    return true;
+}
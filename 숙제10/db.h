@@ -0,0 +1,79 @@
+#ifndef E3B1A8C2_5F4D_4B7E_9A61_2D0C7F3E8B14
+#define E3B1A8C2_5F4D_4B7E_9A61_2D0C7F3E8B14
+
+#include "mpsc_queue.h"
+#include "protocol.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#pragma pack(push, 1)
+struct PlayerRecord {
+    char name[MAX_ID_LEN];
+    short x, y;
+    short hp;
+    short level;
+    int exp;
+    // Wall clock time of the state in milliseconds, see record_time.
+    int64_t saved_at;
+};
+#pragma pack(pop)
+
+// Stamps records and snapshot rows. Both servers stamp them, so a restored
+// snapshot row can be told apart from a save made after it.
+int64_t record_time();
+
+// Write-behind player store.
+// save() only enqueues a record, and a flusher thread appends every queued
+// record to the log file with a single write + fdatasync (group commit).
+// The log is rewritten with only the latest record of each player once it
+// holds twice as many records as there are players.
+class PlayerDB {
+  public:
+    PlayerDB(const std::string &path, std::chrono::milliseconds commit_interval);
+    ~PlayerDB();
+    PlayerDB(const PlayerDB &) = delete;
+    PlayerDB(PlayerDB &&) = delete;
+
+    std::optional<PlayerRecord> load(const std::string &name);
+    void save(const PlayerRecord &record);
+    // Saves a record unless the db already has a newer one of the player.
+    void restore(const PlayerRecord &record);
+
+  private:
+    // Logs below this many records are never compacted while running.
+    static constexpr size_t MIN_COMPACT_RECORDS = 4096;
+
+    void load_log();
+    void compact();
+    bool open_log();
+    bool append(const std::vector<PlayerRecord> &records);
+    void do_flusher();
+    void flush();
+
+    std::string path;
+    int fd{-1};
+    // Whole records in the log, anything past them is a torn write that
+    // is cut off before the next append.
+    size_t log_records{0};
+    bool is_torn{false};
+    std::chrono::milliseconds commit_interval;
+
+    std::unordered_map<std::string, PlayerRecord> index;
+    std::shared_mutex index_lock;
+
+    MPSCQueue<PlayerRecord> write_queue;
+    // Taken from the queue but not yet in the log, only the flusher touches
+    // it.
+    std::vector<PlayerRecord> batch;
+    std::atomic_bool is_running{true};
+    std::thread flusher;
+};
+
+#endif /* E3B1A8C2_5F4D_4B7E_9A61_2D0C7F3E8B14 */
@@ -0,0 +1,84 @@
+#include "entity_table.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static inline void append_matches(unsigned mask, unsigned base,
+                                  const vector<unsigned> &ids,
+                                  vector<unsigned> &out) {
+    // One match sets two bits of a 16bit lane, keep only the even ones.
+    mask &= 0x55555555u;
+    while (mask != 0) {
+        out.emplace_back(ids[base + (__builtin_ctz(mask) >> 1)]);
+        mask &= mask - 1;
+    }
+}
+
+void EntityTable::query_rect(short min_x, short max_x, short min_y,
+                             short max_y, unsigned char required,
+                             unsigned bound, vector<unsigned> &out) const {
+    if (bound > xs.size())
+        bound = xs.size();
+
+    unsigned i = 0;
+
+#if defined(__AVX2__)
+    {
+        const __m256i lo_x = _mm256_set1_epi16(min_x - 1);
+        const __m256i hi_x = _mm256_set1_epi16(max_x + 1);
+        const __m256i lo_y = _mm256_set1_epi16(min_y - 1);
+        const __m256i hi_y = _mm256_set1_epi16(max_y + 1);
+        const __m256i req = _mm256_set1_epi16(required);
+        for (; i + 16 <= bound; i += 16) {
+            __m256i vx = _mm256_loadu_si256((const __m256i *)(&xs[i]));
+            __m256i vy = _mm256_loadu_si256((const __m256i *)(&ys[i]));
+            __m256i vf = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i *)(&flags[i])));
+
+            __m256i hit = _mm256_and_si256(_mm256_cmpgt_epi16(vx, lo_x),
+                                           _mm256_cmpgt_epi16(hi_x, vx));
+            hit = _mm256_and_si256(hit, _mm256_cmpgt_epi16(vy, lo_y));
+            hit = _mm256_and_si256(hit, _mm256_cmpgt_epi16(hi_y, vy));
+            hit = _mm256_and_si256(
+                hit, _mm256_cmpeq_epi16(_mm256_and_si256(vf, req), req));
+
+            append_matches(_mm256_movemask_epi8(hit), i, ids, out);
+        }
+    }
+#elif defined(__SSE2__)
+    {
+        const __m128i lo_x = _mm_set1_epi16(min_x - 1);
+        const __m128i hi_x = _mm_set1_epi16(max_x + 1);
+        const __m128i lo_y = _mm_set1_epi16(min_y - 1);
+        const __m128i hi_y = _mm_set1_epi16(max_y + 1);
+        const __m128i req = _mm_set1_epi16(required);
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 8 <= bound; i += 8) {
+            __m128i vx = _mm_loadu_si128((const __m128i *)(&xs[i]));
+            __m128i vy = _mm_loadu_si128((const __m128i *)(&ys[i]));
+            __m128i vf = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *)(&flags[i])), zero);
+
+            __m128i hit = _mm_and_si128(_mm_cmpgt_epi16(vx, lo_x),
+                                        _mm_cmpgt_epi16(hi_x, vx));
+            hit = _mm_and_si128(hit, _mm_cmpgt_epi16(vy, lo_y));
+            hit = _mm_and_si128(hit, _mm_cmpgt_epi16(hi_y, vy));
+            hit = _mm_and_si128(hit,
+                                _mm_cmpeq_epi16(_mm_and_si128(vf, req), req));
+
+            append_matches(_mm_movemask_epi8(hit), i, ids, out);
+        }
+    }
+#endif
+
+    for (; i < bound; ++i) {
+        if ((flags[i] & required) != required)
+            continue;
+        if (xs[i] < min_x || max_x < xs[i] || ys[i] < min_y || max_y < ys[i])
+            continue;
+        out.emplace_back(ids[i]);
+    }
+}
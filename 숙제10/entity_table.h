@@ -0,0 +1,60 @@
+#ifndef F41C6B2D_8E37_4A95_B0D2_6A7E19C3D558
+#define F41C6B2D_8E37_4A95_B0D2_6A7E19C3D558
+
+#include <cstddef>
+#include <vector>
+
+enum EntityFlag : unsigned char {
+    ENTITY_ACTIVE = 1,
+    ENTITY_LOGGED_IN = 2,
+    ENTITY_PROXY = 4,
+    ENTITY_GHOST = 8,
+};
+
+// Hot entity fields stored as structure of arrays, indexed by the slot
+// index of a client id.
+// SOCKETINFO still owns the authoritative values; every write to them is
+// mirrored here so that proximity scans never touch a SOCKETINFO.
+class EntityTable {
+  public:
+    explicit EntityTable(size_t capacity)
+        : ids(capacity), xs(capacity), ys(capacity), flags(capacity) {}
+
+    size_t capacity() const { return xs.size(); }
+
+    unsigned id(unsigned index) const { return ids[index]; }
+    short x(unsigned index) const { return xs[index]; }
+    short y(unsigned index) const { return ys[index]; }
+    bool has_flags(unsigned index, unsigned char f) const {
+        return (flags[index] & f) == f;
+    }
+
+    void set_id(unsigned index, unsigned id) { ids[index] = id; }
+    void set_position(unsigned index, short x, short y) {
+        xs[index] = x;
+        ys[index] = y;
+    }
+    void set_flags(unsigned index, unsigned char f) { flags[index] = f; }
+    void add_flags(unsigned index, unsigned char f) { flags[index] |= f; }
+    void clear_flags(unsigned index, unsigned char f) { flags[index] &= ~f; }
+
+    // Appends the id of every index in [0, bound) that has all of
+    // `required` flags and lies within `range` tiles of (x, y) on both axes.
+    void query_near(short x, short y, short range, unsigned char required,
+                    unsigned bound, std::vector<unsigned> &out) const {
+        query_rect(x - range, x + range, y - range, y + range, required,
+                   bound, out);
+    }
+    // Same for the rectangle [min_x, max_x] x [min_y, max_y].
+    void query_rect(short min_x, short max_x, short min_y, short max_y,
+                    unsigned char required, unsigned bound,
+                    std::vector<unsigned> &out) const;
+
+  private:
+    std::vector<unsigned> ids;
+    std::vector<short> xs;
+    std::vector<short> ys;
+    std::vector<unsigned char> flags;
+};
+
+#endif /* F41C6B2D_8E37_4A95_B0D2_6A7E19C3D558 */
@@ -1,9 +1,17 @@
+#include "affinity.h"
+#include "id_allocator.h"
+#include "link_writer.h"
+#include "log.h"
+#include "mpsc_queue.h"
 #include "protocol.h"
 #include "toml.hpp"
 #include <atomic>
 #include <boost/asio.hpp>
+#include <deque>
 #include <iostream>
+#include <memory>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
@@ -11,96 +19,173 @@ using namespace boost::asio;
 using namespace boost::asio::ip;
 using boost_error = boost::system::error_code;
 
-constexpr unsigned MAX_USER_NUM = 20000;
+constexpr unsigned MAX_USER_NUM = 1 << 18;
 constexpr unsigned MAX_CLIENT_BUF = 1024;
 
-io_context context;
+// Runs the links to both servers, so their sockets are only touched by one
+// thread whatever loop the clients live on.
+io_context link_context;
 
-template <typename F>
-void send_packet_to_client(tcp::socket &sock, unsigned char packet_size,
-                           char packet_type, F &&packet_maker_func) {
-    unsigned char *packet = new unsigned char[packet_size];
+// Packets waiting for a slow client past which only the latest position of
+// each mover is kept.
+unsigned coalesce_threshold = 64;
 
-    packet_header *header = (packet_header *)packet;
-    header->size = packet_size;
-    header->type = packet_type;
+// A login a busy server turns away goes to the other one, and from the
+// second attempt on only after a delay.
+unsigned login_retries = 4;
+std::chrono::milliseconds login_retry_delay{500};
 
-    packet_maker_func(packet + sizeof(packet_header));
+struct ServerLink;
 
-    sock.async_send(
-        buffer(packet, packet_size), [packet](auto error, auto length) {
-            delete[] packet;
-            if (error) {
-                cerr << "Error at send to client : " << error.message() << endl;
-            }
-        });
-}
+// The new owner waits for it before taking input. The fence stays in the
+// bulk lane, it must not pass the input it closes.
+template <>
+inline constexpr LinkWriter::Lane lane_of<fs_packet_hand_overed> =
+    LinkWriter::Control;
 
 template <typename P, typename F>
-void send_packet_to_server(tcp::socket &sock, unsigned id,
-                           unsigned real_packet_size, F &&packet_maker_func) {
-    unsigned packet_size =
-        sizeof(packet_header) + sizeof(unsigned) + sizeof(P) + real_packet_size;
-    unsigned char *packet = new unsigned char[packet_size];
-
-    packet_header *header = (packet_header *)packet;
-    header->size = packet_size;
-    header->type = P::type_num;
+void send_packet_to_server(ServerLink &link, unsigned id,
+                           unsigned real_packet_size, F &&packet_maker_func);
 
-    unsigned *id_ptr = (unsigned *)(packet + sizeof(packet_header));
-    *id_ptr = id;
-    packet_maker_func(*(P *)(packet + sizeof(packet_header) + sizeof(unsigned)),
-                      packet + (packet_size - real_packet_size));
-
-    sock.async_send(
-        buffer(packet, packet_size), [packet](auto error, auto length) {
-            delete[] packet;
-            if (error) {
-                cerr << "Error at send to server : " << error.message() << endl;
-            }
-        });
-}
-
-struct Client {
+struct Client : enable_shared_from_this<Client> {
     tcp::socket socket;
-    tcp::socket *server_socket;
+    // Serializes the handlers of the client when its loop has many threads.
+    boost::asio::strand<tcp::socket::executor_type> strand;
+    // Only touched on the strand of the client.
+    ServerLink *server;
     unsigned id;
     unsigned char recv_buf[MAX_CLIENT_BUF];
     unsigned prev_recv_len{0};
 
-    Client(tcp::socket &&sock, tcp::socket &server_sock, unsigned id)
-        : socket{move(sock)}, server_socket{&server_sock}, id{id} {}
+    // Packets queued while a write is in flight go out with the next one.
+    // Only touched on the strand of the client.
+    deque<unique_ptr<unsigned char[]>> send_queue;
+    vector<unsigned char> send_buf;
+    bool is_sending{false};
+    bool is_coalescing{false};
+    // Where the queued sc_packet_pos of each mover is, while coalescing.
+    unordered_map<int, size_t> queued_pos;
+
+    // Kept to send again when a busy server rejects it. Only touched on the
+    // strand of the client.
+    vector<unsigned char> login_packet;
+    unsigned login_attempts{0};
+    steady_timer login_timer;
+    bool is_closed{false};
+
+    Client(tcp::socket &&sock, ServerLink &server, unsigned id)
+        : socket{move(sock)}, strand{make_strand(socket.get_executor())},
+          server{&server}, id{id}, login_timer{socket.get_executor()} {}
 
     void recv() {
         socket.async_read_some(
             buffer(recv_buf + prev_recv_len, MAX_CLIENT_BUF - prev_recv_len),
-            [this](auto error, auto len) { handle_recv(error, len); });
+            bind_executor(strand,
+                          [self{shared_from_this()}](auto error, auto len) {
+                              self->handle_recv(error, len);
+                          }));
     }
 
     void handle_recv(boost_error error, size_t received_bytes) {
-        if (error) {
-            cerr << "Error at handle_recv of a client(#" << id
-                 << ") : " << error.message() << endl;
-            send_packet_to_server<fs_packet_logout>(
-                *server_socket, id, 0, [](auto &_, unsigned char *extra) {});
-        } else if (received_bytes == 0) {
+        if (error || received_bytes == 0) {
+            if (error && error != error::eof) {
+                LOG(LogWarn, "Error at handle_recv of a client(#", id,
+                    ") : ", error.message());
+            }
+            // The id is recycled once sf_packet_logout_done comes back. The
+            // other server sends it after any ghost or proxy of the client
+            // is gone from it.
             send_packet_to_server<fs_packet_logout>(
-                *server_socket, id, 0, [](auto &_, unsigned char *extra) {});
+                *server, id, 0, [](auto &, unsigned char *) {});
+            is_closed = true;
+            login_timer.cancel();
+            boost_error ec;
+            socket.close(ec);
+            return;
         }
 
         assemble_packet(recv_buf, prev_recv_len, received_bytes,
                         [this](unsigned char *packet, unsigned packet_size) {
-                            send_packet_to_server<fs_packet_forwarding>(
-                                *server_socket, id, packet_size,
-                                [real_packet{packet},
-                                 packet_size](fs_packet_forwarding &packet,
-                                              unsigned char *extra) {
-                                    memcpy(extra, real_packet, packet_size);
-                                });
+                            if (packet[1] == cs_packet_login::type_num)
+                                login_packet.assign(packet,
+                                                    packet + packet_size);
+                            forward(packet, packet_size);
                         });
         recv();
     }
 
+    void forward(const unsigned char *real_packet, unsigned packet_size) {
+        send_packet_to_server<fs_packet_forwarding>(
+            *server, id, packet_size,
+            [real_packet, packet_size](fs_packet_forwarding &,
+                                       unsigned char *extra) {
+                memcpy(extra, real_packet, packet_size);
+            });
+    }
+
+    void retry_login();
+
+    // A newer position of a mover replaces its queued one in place. A put
+    // or remove of the mover ends that, so a position never jumps ahead of
+    // them. The client's own positions carry move_time and all go out.
+    void send(unique_ptr<unsigned char[]> packet) {
+        // put, remove and pos all start with the id of the mover.
+        auto mover_of = [](unsigned char *packet) {
+            return *(int *)(packet + sizeof(packet_header));
+        };
+        if (is_coalescing) {
+            switch (packet[1]) {
+            case sc_packet_pos::type_num: {
+                auto mover = mover_of(packet.get());
+                if (unsigned(mover) == id)
+                    break;
+                auto it = queued_pos.find(mover);
+                if (it != queued_pos.end()) {
+                    send_queue[it->second] = move(packet);
+                    return;
+                }
+                queued_pos.emplace(mover, send_queue.size());
+            } break;
+            case sc_packet_put_object::type_num:
+            case sc_packet_remove_object::type_num:
+                queued_pos.erase(mover_of(packet.get()));
+                break;
+            }
+        }
+        send_queue.emplace_back(move(packet));
+        if (send_queue.size() >= coalesce_threshold)
+            is_coalescing = true;
+        flush();
+    }
+
+    void flush() {
+        if (is_sending || send_queue.empty())
+            return;
+        send_buf.clear();
+        for (auto &packet : send_queue)
+            send_buf.insert(send_buf.end(), packet.get(),
+                            packet.get() + packet[0]);
+        send_queue.clear();
+        queued_pos.clear();
+
+        is_sending = true;
+        async_write(
+            socket, buffer(send_buf),
+            bind_executor(strand, [self{shared_from_this()}](auto error,
+                                                             auto) {
+                self->is_sending = false;
+                if (error) {
+                    LOG(LogWarn, "Error at send to client(#", self->id,
+                        ") : ", error.message());
+                    self->send_queue.clear();
+                }
+                // Caught up once what piled up during the write is small.
+                if (self->send_queue.size() < coalesce_threshold / 4)
+                    self->is_coalescing = false;
+                self->flush();
+            }));
+    }
+
     template <typename F>
     void assemble_packet(unsigned char *recv_buf, unsigned &prev_packet_size,
                          size_t received_bytes, F &&packet_handler) {
@@ -131,13 +216,49 @@ struct Client {
     }
 };
 
-Client *clients[20000];
+IdAllocator user_ids{MAX_USER_NUM};
+shared_ptr<Client> clients[MAX_USER_NUM];
+
+// Returns nullptr for ids whose slot has been recycled since.
+shared_ptr<Client> find_client(unsigned id) {
+    if (!user_ids.is_current(id))
+        return nullptr;
+    auto client = atomic_load(&clients[id_index(id)]);
+    if (client == nullptr || client->id != id)
+        return nullptr;
+    return client;
+}
+
+template <typename F>
+void send_packet_to_client(const shared_ptr<Client> &client,
+                           unsigned char packet_size, char packet_type,
+                           F &&packet_maker_func) {
+    unique_ptr<unsigned char[]> packet{new unsigned char[packet_size]};
 
-struct ServerData {
-    tcp::socket socket{context};
+    packet_header *header = (packet_header *)packet.get();
+    header->size = packet_size;
+    header->type = packet_type;
+
+    packet_maker_func(packet.get() + sizeof(packet_header));
+
+    // The socket of the client belongs to the loop of the client.
+    post(client->strand, [packet{move(packet)}, client]() mutable {
+        client->send(move(packet));
+    });
+}
+
+struct ServerLink {
+    tcp::socket socket{link_context};
     unsigned char recv_buf[MAX_BUFFER];
     unsigned prev_packet_size{0};
-    ServerData *other;
+    ServerLink *other;
+
+    // Any loop hands packets over, the link thread writes them.
+    LinkWriter writer{socket};
+
+    void send(unique_ptr<unsigned char[]> packet, LinkWriter::Lane lane) {
+        writer.send(move(packet), lane);
+    }
 
     void recv() {
         socket.async_read_some(
@@ -164,28 +285,71 @@ struct ServerData {
                    unsigned id, unsigned char *packet) {
                 switch (packet_type) {
                 case sf_packet_hand_over::type_num: {
-                    if (id >= 20000) {
-                        cerr << "Wrong ID #" << id << endl;
+                    auto client = find_client(id);
+                    if (client == nullptr)
                         return;
-                    }
-                    auto &client = clients[id];
-                    client->server_socket = &other->socket;
-                    send_packet_to_server<fs_packet_hand_overed>(
-                        *client->server_socket, client->id, 0,
-                        [](fs_packet_hand_overed &packet,
-                           unsigned char *extra) {});
+                    // Switched on the strand of the client, so no input of
+                    // it can be queued to the old owner after the fence.
+                    post(client->strand, [this, client]() {
+                        client->server = other;
+                        send_packet_to_server<fs_packet_hand_overed>(
+                            *other, client->id, 0,
+                            [](fs_packet_hand_overed &, unsigned char *) {});
+                        // Tells the old owner it has seen every input it
+                        // will ever get from this client.
+                        send_packet_to_server<fs_packet_hand_over_fence>(
+                            *this, client->id, 0,
+                            [](fs_packet_hand_over_fence &,
+                               unsigned char *) {});
+                    });
                 } break;
                 case sf_packet_reject_login::type_num: {
+                    auto client = find_client(id);
+                    if (client == nullptr)
+                        return;
+                    auto reject = (sf_packet_reject_login *)packet;
+                    if (reject->reason == REJECT_BUSY) {
+                        post(client->strand,
+                             [client]() { client->retry_login(); });
+                        return;
+                    }
+                    send_packet_to_client(
+                        client,
+                        sizeof(packet_header) + sizeof(sc_packet_login_fail),
+                        sc_packet_login_fail::type_num,
+                        [](unsigned char *) {});
+                } break;
+                case sf_packet_multicast::type_num: {
+                    auto multicast = (sf_packet_multicast *)packet;
+                    auto ids = (unsigned *)(multicast + 1);
+                    auto inner = (unsigned char *)(ids + multicast->count);
+                    for (unsigned i = 0; i < multicast->count; ++i) {
+                        auto client = find_client(ids[i]);
+                        if (client == nullptr)
+                            continue;
+                        send_packet_to_client(
+                            client, inner[0], inner[1],
+                            [inner](unsigned char *buf) {
+                                memcpy(buf, inner + sizeof(packet_header),
+                                       inner[0] - sizeof(packet_header));
+                            });
+                    }
+                } break;
+                case sf_packet_logout_done::type_num: {
+                    auto client = find_client(id);
+                    if (client == nullptr)
+                        return;
+                    atomic_store(&clients[id_index(id)], shared_ptr<Client>{});
+                    user_ids.release(id);
                 } break;
                 default: {
                     unsigned char new_packet_size =
                         packet_size - sizeof(unsigned);
-                    if (id >= 20000) {
-                        cerr << "Wrong ID #" << id << endl;
+                    auto client = find_client(id);
+                    if (client == nullptr)
                         return;
-                    }
                     send_packet_to_client(
-                        clients[id]->socket, new_packet_size, packet_type,
+                        client, new_packet_size, packet_type,
                         [packet, new_packet_size](unsigned char *buf) {
                             memcpy(buf, packet,
                                    new_packet_size - sizeof(packet_header));
@@ -228,22 +392,77 @@ struct ServerData {
     }
 };
 
-ServerData server1, server2;
+template <typename P, typename F>
+void send_packet_to_server(ServerLink &link, unsigned id,
+                           unsigned real_packet_size, F &&packet_maker_func) {
+    unsigned packet_size =
+        sizeof(packet_header) + sizeof(unsigned) + sizeof(P) + real_packet_size;
+    unique_ptr<unsigned char[]> packet{new unsigned char[packet_size]};
 
-atomic_uint next_user_id{0};
+    packet_header *header = (packet_header *)packet.get();
+    header->size = packet_size;
+    header->type = P::type_num;
 
-void handle_accept(tcp::socket &&sock, tcp::acceptor &acceptor) {
-    auto new_user_id = next_user_id.fetch_add(1, memory_order_relaxed);
+    unsigned *id_ptr = (unsigned *)(packet.get() + sizeof(packet_header));
+    *id_ptr = id;
+    packet_maker_func(
+        *(P *)(packet.get() + sizeof(packet_header) + sizeof(unsigned)),
+        packet.get() + (packet_size - real_packet_size));
+
+    link.send(move(packet), lane_of<P>);
+}
+
+void Client::retry_login() {
+    if (is_closed)
+        return;
+    if (login_packet.empty() || login_attempts >= login_retries) {
+        send_packet_to_client(
+            shared_from_this(),
+            sizeof(packet_header) + sizeof(sc_packet_login_fail),
+            sc_packet_login_fail::type_num, [](unsigned char *) {});
+        return;
+    }
+
+    ++login_attempts;
+    server = server->other;
+    if (login_attempts == 1) {
+        forward(login_packet.data(), login_packet.size());
+        return;
+    }
+    // Both servers have been busy, give them time to catch up.
+    login_timer.expires_after(login_retry_delay);
+    login_timer.async_wait(
+        bind_executor(strand, [self{shared_from_this()}](auto error) {
+            if (error || self->is_closed)
+                return;
+            self->forward(self->login_packet.data(),
+                          self->login_packet.size());
+        }));
+}
+
+ServerLink server1, server2;
 
-    tcp::socket *server_sock;
-    if (new_user_id % 2 == 0) {
-        server_sock = &server1.socket;
+atomic_uint next_server{0};
+
+// A client stays on the loop that accepted it.
+void handle_accept(tcp::socket &&sock, tcp::acceptor &acceptor) {
+    auto new_user_id = user_ids.allocate();
+    if (!new_user_id) {
+        cerr << "Too many users" << endl;
+        boost_error ec;
+        sock.close(ec);
     } else {
-        server_sock = &server2.socket;
+        ServerLink *server;
+        if (next_server.fetch_add(1, memory_order_relaxed) % 2 == 0) {
+            server = &server1;
+        } else {
+            server = &server2;
+        }
+        auto new_client =
+            make_shared<Client>(move(sock), *server, *new_user_id);
+        atomic_store(&clients[id_index(*new_user_id)], new_client);
+        new_client->recv();
     }
-    Client *new_client = new Client{move(sock), *server_sock, new_user_id};
-    clients[new_user_id] = new_client;
-    new_client->recv();
 
     acceptor.async_accept(
         [&acceptor](const boost_error &error, tcp::socket sock) {
@@ -276,6 +495,28 @@ void connect_to_servers(const tcp::endpoint &end_point1,
     server2.recv();
 }
 
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+void start_accept(tcp::acceptor &acceptor, unsigned short port,
+                  bool is_reuse_port) {
+    auto end_point = tcp::endpoint{tcp::v4(), port};
+    acceptor.open(end_point.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address{true});
+    if (is_reuse_port)
+        acceptor.set_option(reuse_port{true});
+    acceptor.bind(end_point);
+    acceptor.listen();
+
+    acceptor.async_accept(
+        [&acceptor](const boost_error &error, tcp::socket sock) {
+            if (error) {
+                cerr << "Error in accept : " << error.message() << endl;
+            } else {
+                handle_accept(move(sock), acceptor);
+            }
+        });
+}
+
 int main() {
     auto config = toml::parse("config.toml");
     const unsigned short port =
@@ -286,27 +527,63 @@ int main() {
         toml::find<unsigned short>(config, "server1_port");
     const unsigned short server2_port =
         toml::find<unsigned short>(config, "server2_port");
+    const unsigned num_threads = toml::find_or<unsigned>(config, "threads", 8);
+    // Every loop thread and the link thread use the MPSC queues of the links.
+    if (num_threads == 0 || num_threads + 1 > MAX_EPOCH_THREADS) {
+        cerr << "threads must be between 1 and " << MAX_EPOCH_THREADS - 1
+             << endl;
+        exit(-1);
+    }
+    // One loop and one SO_REUSEPORT acceptor per thread instead of one
+    // shared loop.
+    const bool is_loop_per_thread =
+        toml::find_or<bool>(config, "loop_per_thread", false);
+    coalesce_threshold =
+        toml::find_or<unsigned>(config, "coalesce_threshold", 64);
+    login_retries = toml::find_or<unsigned>(config, "login_retries", 4);
+    login_retry_delay = std::chrono::milliseconds{
+        toml::find_or<unsigned>(config, "login_retry_delay_ms", 500)};
+    CpuList link_cpus;
+    vector<CpuList> loop_cpus;
+    if (config.contains("affinity")) {
+        const auto &affinity = toml::find(config, "affinity");
+        link_cpus = parse_cpu_list(toml::find_or<string>(affinity, "link", ""));
+        for (auto &cpus : toml::find_or<vector<string>>(affinity, "loops",
+                                                         vector<string>{}))
+            loop_cpus.emplace_back(parse_cpu_list(cpus));
+    }
 
     connect_to_servers(
         tcp::endpoint{make_address_v4(server1_ip), server1_port},
         tcp::endpoint{make_address_v4(server2_ip), server2_port});
 
-    tcp::acceptor acceptor{context, tcp::endpoint{tcp::v4(), port}};
-    acceptor.async_accept(
-        [&acceptor](const boost_error &error, tcp::socket sock) {
-            if (error) {
-                cerr << "Error in accept : " << error.message() << endl;
-            } else {
-                handle_accept(move(sock), acceptor);
-            }
-        });
+    thread link_thread{[&link_cpus]() {
+        if (!pin_this_thread(link_cpus))
+            cerr << "Can't pin the link thread" << endl;
+        link_context.run();
+    }};
+
+    const unsigned num_loops = is_loop_per_thread ? num_threads : 1;
+    vector<unique_ptr<io_context>> contexts;
+    vector<unique_ptr<tcp::acceptor>> acceptors;
+    for (unsigned i = 0; i < num_loops; ++i) {
+        contexts.emplace_back(make_unique<io_context>());
+        acceptors.emplace_back(make_unique<tcp::acceptor>(*contexts.back()));
+        start_accept(*acceptors.back(), port, is_loop_per_thread);
+    }
 
     vector<thread> workers;
-    for (auto i = 0; i < 8; ++i) {
-        workers.emplace_back([]() { context.run(); });
+    for (unsigned i = 0; i < num_threads; ++i) {
+        auto &context = *contexts[i % num_loops];
+        workers.emplace_back([&context, cpus{cpus_of(loop_cpus, i)}, i]() {
+            if (!pin_this_thread(cpus))
+                cerr << "Can't pin loop thread " << i << endl;
+            context.run();
+        });
     }
 
     for (auto &t : workers) {
         t.join();
     }
+    link_thread.join();
 }
@@ -0,0 +1,136 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <vector>
+
+// A client id is a slot index tagged with the generation of the slot, so
+// packets addressed to a previous owner of the slot can be told apart.
+constexpr unsigned ID_INDEX_BITS = 20;
+constexpr unsigned ID_INDEX_MASK = (1u << ID_INDEX_BITS) - 1;
+constexpr unsigned ID_GENERATION_MASK = 0x7FF;
+constexpr unsigned INVALID_CLIENT_ID = -1;
+
+inline unsigned id_index(unsigned id) { return id & ID_INDEX_MASK; }
+inline unsigned id_generation(unsigned id) { return id >> ID_INDEX_BITS; }
+inline unsigned make_client_id(unsigned index, unsigned generation) {
+    return ((generation & ID_GENERATION_MASK) << ID_INDEX_BITS) | index;
+}
+
+// Hands out the lowest free index first, so the highest live index (bound)
+// follows the number of live clients instead of the historical peak.
+class IdAllocator {
+  public:
+    explicit IdAllocator(unsigned capacity)
+        : current{new std::atomic_uint[capacity]},
+          last_ids(capacity, INVALID_CLIENT_ID), in_use(capacity, false),
+          capacity{capacity} {
+        for (unsigned i = 0; i < capacity; ++i)
+            current[i].store(INVALID_CLIENT_ID, std::memory_order_relaxed);
+    }
+    IdAllocator(const IdAllocator &) = delete;
+    IdAllocator(IdAllocator &&) = delete;
+
+    std::optional<unsigned> allocate() {
+        std::lock_guard<std::mutex> lg{lock};
+        unsigned index;
+        if (!free_indices.empty()) {
+            index = *free_indices.begin();
+            free_indices.erase(free_indices.begin());
+        } else if (bound_ < capacity) {
+            index = bound_;
+            set_bound(bound_ + 1);
+        } else {
+            return std::nullopt;
+        }
+
+        auto old_id = last_ids[index];
+        auto generation =
+            old_id == INVALID_CLIENT_ID ? 0 : id_generation(old_id) + 1;
+        auto id = make_client_id(index, generation);
+        mark_live(index, id);
+        return id;
+    }
+
+    // Marks an id handed out by another allocator as live here.
+    void acquire(unsigned id) {
+        auto index = id_index(id);
+        if (index >= capacity)
+            return;
+
+        std::lock_guard<std::mutex> lg{lock};
+        if (!in_use[index]) {
+            if (index >= bound_) {
+                for (auto i = bound_; i < index; ++i)
+                    free_indices.emplace(i);
+                set_bound(index + 1);
+            } else {
+                free_indices.erase(index);
+            }
+        }
+        mark_live(index, id);
+    }
+
+    bool release(unsigned id) {
+        auto index = id_index(id);
+        if (index >= capacity)
+            return false;
+
+        std::lock_guard<std::mutex> lg{lock};
+        if (!in_use[index] ||
+            current[index].load(std::memory_order_relaxed) != id)
+            return false;
+
+        in_use[index] = false;
+        current[index].store(INVALID_CLIENT_ID, std::memory_order_release);
+        live_num.fetch_sub(1, std::memory_order_relaxed);
+        if (index + 1 == bound_) {
+            auto new_bound = index;
+            while (new_bound > 0 && !in_use[new_bound - 1]) {
+                free_indices.erase(new_bound - 1);
+                --new_bound;
+            }
+            set_bound(new_bound);
+        } else {
+            free_indices.emplace(index);
+        }
+        return true;
+    }
+
+    bool is_current(unsigned id) const {
+        auto index = id_index(id);
+        return index < capacity &&
+               current[index].load(std::memory_order_acquire) == id;
+    }
+
+    unsigned bound() const {
+        return published_bound.load(std::memory_order_acquire);
+    }
+    unsigned live() const { return live_num.load(std::memory_order_relaxed); }
+
+  private:
+    void mark_live(unsigned index, unsigned id) {
+        if (!in_use[index]) {
+            in_use[index] = true;
+            live_num.fetch_add(1, std::memory_order_relaxed);
+        }
+        last_ids[index] = id;
+        current[index].store(id, std::memory_order_release);
+    }
+    void set_bound(unsigned new_bound) {
+        bound_ = new_bound;
+        published_bound.store(new_bound, std::memory_order_release);
+    }
+
+    std::unique_ptr<std::atomic_uint[]> current;
+    std::vector<unsigned> last_ids;
+    std::vector<bool> in_use;
+    std::set<unsigned> free_indices;
+    std::mutex lock;
+    const unsigned capacity;
+    unsigned bound_{0};
+    std::atomic_uint published_bound{0};
+    std::atomic_uint live_num{0};
+};
@@ -0,0 +1,89 @@
+#pragma once
+#include "log.h"
+#include "mpsc_queue.h"
+#include <array>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Writes packets to a socket shared by many threads. Packets are staged in
+// one queue per lane, and every write takes all staged control packets
+// before any bulk one, so a handover does not wait behind position updates.
+// Packets of one lane keep their order, packets of different lanes may not.
+// Only the thread running the executor of the socket writes.
+class LinkWriter {
+  public:
+    enum Lane { Control, Bulk, NUM_LANES };
+
+    explicit LinkWriter(boost::asio::ip::tcp::socket &socket)
+        : socket{socket} {}
+    LinkWriter(const LinkWriter &) = delete;
+    LinkWriter(LinkWriter &&) = delete;
+
+    void send(std::unique_ptr<unsigned char[]> packet, Lane lane) {
+        auto size = packet[0];
+        send(std::move(packet), size, lane);
+    }
+    // `packets` may hold several packets back to back, they go out together.
+    void send(std::unique_ptr<unsigned char[]> packets, size_t size,
+              Lane lane) {
+        lanes[lane].emplace(std::move(packets), size);
+        if (!is_flush_posted.exchange(true)) {
+            boost::asio::post(socket.get_executor(), [this]() {
+                is_flush_posted.store(false);
+                flush();
+            });
+        }
+    }
+
+  private:
+    // Bulk packets past this wait for the next write, so control packets
+    // staged meanwhile get ahead of them.
+    static constexpr size_t MAX_WRITE_SIZE = 64 * 1024;
+
+    void flush() {
+        if (is_writing)
+            return;
+        write_buf.clear();
+        lanes[Control].for_each([this](Staged staged) {
+            write_buf.insert(write_buf.end(), staged.first.get(),
+                             staged.first.get() + staged.second);
+        });
+        while (write_buf.size() < MAX_WRITE_SIZE) {
+            auto staged = lanes[Bulk].deq();
+            if (!staged)
+                break;
+            write_buf.insert(write_buf.end(), staged->first.get(),
+                             staged->first.get() + staged->second);
+        }
+        if (write_buf.empty())
+            return;
+
+        is_writing = true;
+        boost::asio::async_write(
+            socket, boost::asio::buffer(write_buf),
+            [this](auto error, auto) {
+                is_writing = false;
+                if (error) {
+                    LOG(LogError, "Error at send to link : ",
+                        error.message());
+                }
+                flush();
+            });
+    }
+
+    using Staged = std::pair<std::unique_ptr<unsigned char[]>, size_t>;
+
+    boost::asio::ip::tcp::socket &socket;
+    std::array<MPSCQueue<Staged>, NUM_LANES> lanes;
+    std::atomic_bool is_flush_posted{false};
+    // Only touched by the thread running the executor.
+    bool is_writing{false};
+    std::vector<unsigned char> write_buf;
+};
+
+// Lane a packet type travels in. Each side marks its control packets.
+template <typename P>
+inline constexpr LinkWriter::Lane lane_of = LinkWriter::Bulk;
@@ -0,0 +1,223 @@
+#pragma once
+#include "spsc_queue.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Diagnostics for paths a client can trigger at will. A line is formatted
+// into a queue of the calling thread and a flusher thread writes the lines
+// of every thread to stderr, so a flood of them takes no lock shared by the
+// workers. Each call site lets LOG_BURST lines a second through and counts
+// the rest, which the flusher reports. Levels below LOG_MIN_LEVEL are
+// compiled out.
+//
+//   LOG(LogWarn, "Unknown type has been received : ", type);
+enum LogLevel { LogDebug, LogInfo, LogWarn, LogError };
+
+#ifndef LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define LOG_MIN_LEVEL LogInfo
+#else
+#define LOG_MIN_LEVEL LogDebug
+#endif
+#endif
+
+#ifndef LOG_BURST
+#define LOG_BURST 10
+#endif
+
+// One LOG call in the source. Lives as long as the program.
+class LogSite {
+  public:
+    LogSite(LogLevel level, const char *file, int line)
+        : level{level}, file{base_name(file)}, line{line} {
+        next = sites().load(std::memory_order_relaxed);
+        while (!sites().compare_exchange_weak(next, this))
+            ;
+    }
+    LogSite(const LogSite &) = delete;
+    LogSite(LogSite &&) = delete;
+
+    // Whether a line may go out now, counts it as suppressed if not.
+    bool admit() {
+        auto second = std::chrono::duration_cast<std::chrono::seconds>(
+                          std::chrono::steady_clock::now().time_since_epoch())
+                          .count();
+        auto window = window_start.load(std::memory_order_relaxed);
+        if (window != second &&
+            window_start.compare_exchange_strong(window, second))
+            in_window.store(0, std::memory_order_relaxed);
+        if (in_window.fetch_add(1, std::memory_order_relaxed) < LOG_BURST)
+            return true;
+        suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    static std::atomic<LogSite *> &sites() {
+        static std::atomic<LogSite *> head{nullptr};
+        return head;
+    }
+
+    const LogLevel level;
+    const char *const file;
+    const int line;
+    LogSite *next;
+    std::atomic_uint64_t suppressed{0};
+
+  private:
+    static const char *base_name(const char *path) {
+        auto slash = std::strrchr(path, '/');
+        return slash ? slash + 1 : path;
+    }
+
+    std::atomic<int64_t> window_start{0};
+    std::atomic_uint in_window{0};
+};
+
+class Logger {
+  public:
+    // Never destroyed, the flusher runs until the process ends.
+    static Logger &instance() {
+        static Logger *logger = new Logger;
+        return *logger;
+    }
+
+    void write(const LogSite &site, std::string text) {
+        auto &buffer = buffer_of_this_thread();
+        // A flusher that fell behind costs lines, never memory or time.
+        if (buffer.lines.size() >= MAX_PENDING_LINES) {
+            buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        buffer.lines.emplace(Line{&site, std::chrono::system_clock::now(),
+                                  std::move(text)});
+    }
+
+  private:
+    static constexpr size_t MAX_PENDING_LINES = 4096;
+    static constexpr std::chrono::milliseconds FLUSH_INTERVAL{100};
+
+    struct Line {
+        const LogSite *site;
+        std::chrono::system_clock::time_point time;
+        std::string text;
+    };
+
+    struct ThreadBuffer {
+        explicit ThreadBuffer(unsigned thread_no) : thread_no{thread_no} {}
+
+        const unsigned thread_no;
+        SPSCQueue<Line> lines;
+        std::atomic_uint64_t dropped{0};
+    };
+
+    Logger() = default;
+
+    ThreadBuffer &buffer_of_this_thread() {
+        thread_local ThreadBuffer *buffer = nullptr;
+        if (buffer != nullptr)
+            return *buffer;
+        std::lock_guard<std::mutex> lg{buffers_lock};
+        // Kept after the thread ends, the flusher may still be reading it.
+        buffers.emplace_back(std::make_unique<ThreadBuffer>(buffers.size()));
+        buffer = buffers.back().get();
+        if (!is_flusher_started) {
+            is_flusher_started = true;
+            std::thread{[this]() { flush_forever(); }}.detach();
+        }
+        return *buffer;
+    }
+
+    void flush_forever() {
+        std::string out;
+        while (true) {
+            std::this_thread::sleep_for(FLUSH_INTERVAL);
+            out.clear();
+            {
+                std::lock_guard<std::mutex> lg{buffers_lock};
+                for (auto &buffer : buffers) {
+                    buffer->lines.for_each([&out, &buffer](Line line) {
+                        append(out, line.time, line.site, buffer->thread_no,
+                               line.text);
+                    });
+                    if (auto dropped = buffer->dropped.exchange(0))
+                        append(out, std::chrono::system_clock::now(), nullptr,
+                               buffer->thread_no,
+                               std::to_string(dropped) + " lines dropped");
+                }
+            }
+            for (auto site = LogSite::sites().load(); site != nullptr;
+                 site = site->next) {
+                if (auto suppressed = site->suppressed.exchange(0))
+                    append(out, std::chrono::system_clock::now(), site, -1,
+                           std::to_string(suppressed) + " lines suppressed");
+            }
+            if (!out.empty())
+                std::cerr.write(out.data(), out.size());
+        }
+    }
+
+    static void append(std::string &out,
+                       std::chrono::system_clock::time_point time,
+                       const LogSite *site, int thread_no,
+                       const std::string &text) {
+        static const char *const level_names[] = {"DEBUG", "INFO", "WARN",
+                                                  "ERROR"};
+        auto seconds = std::chrono::system_clock::to_time_t(time);
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      time.time_since_epoch())
+                      .count() %
+                  1000;
+        std::tm tm;
+        localtime_r(&seconds, &tm);
+        char stamp[32];
+        auto len = std::strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+        std::snprintf(stamp + len, sizeof(stamp) - len, ".%03d", int(ms));
+
+        out += stamp;
+        out += ' ';
+        out += site ? level_names[site->level] : "WARN";
+        if (site) {
+            out += ' ';
+            out += site->file;
+            out += ':';
+            out += std::to_string(site->line);
+        }
+        if (thread_no >= 0) {
+            out += " thread=";
+            out += std::to_string(thread_no);
+        }
+        out += ' ';
+        out += text;
+        out += '\n';
+    }
+
+    std::mutex buffers_lock;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    bool is_flusher_started{false};
+};
+
+template <typename... Args>
+void log_line(const LogSite &site, const Args &...args) {
+    std::ostringstream os;
+    (os << ... << args);
+    Logger::instance().write(site, os.str());
+}
+
+#define LOG(level, ...)                                                        \
+    do {                                                                       \
+        if constexpr ((level) >= LOG_MIN_LEVEL) {                              \
+            static LogSite log_site{(level), __FILE__, __LINE__};              \
+            if (log_site.admit())                                              \
+                log_line(log_site, __VA_ARGS__);                               \
+        }                                                                      \
+    } while (false)
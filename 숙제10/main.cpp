@@ -1,3 +1,4 @@
+#include "affinity.h"
 #include "protocol.h"
 #include "server.h"
 #include "toml.hpp"
@@ -17,13 +18,41 @@ using namespace std::chrono;
 
 int main() {
     auto config = toml::parse("config.toml");
-    const unsigned id = toml::find<unsigned>(config, "id");
-    const unsigned short port = toml::find<unsigned short>(config, "accept_port");
-    const unsigned short other_server_accept_port = toml::find<unsigned short>(config, "other_server_accept_port");
+    ServerConfig server_config;
+    server_config.id = toml::find<unsigned>(config, "id");
+    server_config.accept_port = toml::find<unsigned short>(config, "accept_port");
+    server_config.other_server_accept_port = toml::find<unsigned short>(config, "other_server_accept_port");
+    server_config.db_path = toml::find_or<string>(config, "db_path", "players.db");
+    server_config.db_commit_interval = milliseconds{toml::find_or<unsigned>(config, "db_commit_interval_ms", 10)};
+    server_config.db_save_interval = seconds{toml::find_or<unsigned>(config, "db_save_interval_s", 60)};
+    server_config.name_directory_capacity = toml::find_or<unsigned>(config, "name_directory_capacity", 1 << 18);
+    server_config.metrics_interval = seconds{toml::find_or<unsigned>(config, "metrics_interval_s", 10)};
+    server_config.hysteresis_step = toml::find_or<short>(config, "hand_over_hysteresis_step", 2);
+    server_config.hysteresis_max = toml::find_or<short>(config, "hand_over_hysteresis_max", 4);
+    server_config.wait_policy.spin_count = toml::find_or<unsigned>(config, "worker_spin_count", 1000);
+    server_config.wait_policy.yield_count = toml::find_or<unsigned>(config, "worker_yield_count", 10);
+    server_config.snapshot_path = toml::find_or<string>(config, "snapshot_path", "world_" + to_string(server_config.id) + ".snap");
+    server_config.snapshot_interval = milliseconds{toml::find_or<unsigned>(config, "snapshot_interval_ms", 1000)};
+    server_config.hysteresis_window = milliseconds{toml::find_or<unsigned>(config, "hand_over_hysteresis_window_ms", 3000)};
+    server_config.load_interval = milliseconds{toml::find_or<unsigned>(config, "load_interval_ms", 100)};
+    server_config.shed_load = toml::find_or<double>(config, "shed_load", 0.75);
+    server_config.overload_load = toml::find_or<double>(config, "overload_load", 0.9);
+    server_config.max_backlog = toml::find_or<size_t>(config, "max_backlog", 10000);
+    server_config.instance_count = toml::find_or<unsigned>(config, "instance_count", 0);
+    server_config.instance_width = toml::find_or<short>(config, "instance_width", 20);
+    server_config.instance_height = toml::find_or<short>(config, "instance_height", 20);
+    server_config.instance_capacity = toml::find_or<unsigned>(config, "instance_capacity", 32);
+    if (config.contains("affinity")) {
+        const auto &affinity = toml::find(config, "affinity");
+        server_config.io_cpus = parse_cpu_list(toml::find_or<string>(affinity, "io", ""));
+        server_config.scheduler_cpus = parse_cpu_list(toml::find_or<string>(affinity, "scheduler", ""));
+        for (auto &cpus : toml::find_or<vector<string>>(affinity, "workers", vector<string>{}))
+            server_config.worker_cpus.emplace_back(parse_cpu_list(cpus));
+    }
     const string other_server_ip = toml::find<string>(config, "other_server_ip");
     const unsigned short other_server_port = toml::find<unsigned short>(config, "other_server_port");
     try {
-        Server server{id, port, other_server_accept_port};
+        Server server{server_config};
         server.run(other_server_ip, other_server_port);
     } catch (const std::exception &e) {
         cerr << "Error at main: " << e.what() << endl;
@@ -0,0 +1,80 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Lock-free latency histogram with power of two microsecond buckets.
+class Histogram {
+  public:
+    explicit Histogram(const char *name) : name{name} {}
+    Histogram(const Histogram &) = delete;
+    Histogram(Histogram &&) = delete;
+
+    void record(std::chrono::nanoseconds duration) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                      duration)
+                      .count();
+        if (us < 0)
+            us = 0;
+        unsigned bucket = 0;
+        while (bucket + 1 < NUM_BUCKETS &&
+               (uint64_t(1) << bucket) <= uint64_t(us))
+            ++bucket;
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+
+        auto old_max = max_us.load(std::memory_order_relaxed);
+        while (old_max < uint64_t(us) &&
+               !max_us.compare_exchange_weak(old_max, us))
+            ;
+    }
+
+    // Upper bound of the bucket holding the p-th percentile, in microseconds.
+    uint64_t percentile(double p) const {
+        auto total = count.load(std::memory_order_relaxed);
+        if (total == 0)
+            return 0;
+        uint64_t target = total * p / 100.0;
+        uint64_t seen = 0;
+        uint64_t max = max_us.load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < NUM_BUCKETS; ++i) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen > target)
+                return std::min(uint64_t(1) << i, max);
+        }
+        return max;
+    }
+
+    void print(std::ostream &os) const {
+        os << name << " count=" << count.load(std::memory_order_relaxed)
+           << " p50<=" << percentile(50) << "us p99<=" << percentile(99)
+           << "us max=" << max_us.load(std::memory_order_relaxed) << "us";
+    }
+
+  private:
+    static constexpr unsigned NUM_BUCKETS = 32;
+
+    const char *name;
+    std::array<std::atomic_uint64_t, NUM_BUCKETS> buckets{};
+    std::atomic_uint64_t count{0};
+    std::atomic_uint64_t max_us{0};
+};
+
+class Counter {
+  public:
+    explicit Counter(const char *name) : name{name} {}
+    Counter(const Counter &) = delete;
+    Counter(Counter &&) = delete;
+
+    void add(uint64_t n = 1) { count.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return count.load(std::memory_order_relaxed); }
+
+    void print(std::ostream &os) const { os << name << "=" << value(); }
+
+  private:
+    const char *name;
+    std::atomic_uint64_t count{0};
+};
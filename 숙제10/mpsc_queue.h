@@ -12,8 +12,11 @@ struct ThreadEpoch {
     std::atomic<ThreadEpoch *> next{nullptr};
 };
 
+// Threads that ever use an MPSCQueue, each keeps its entry for good.
+static constexpr unsigned MAX_EPOCH_THREADS = 64;
+
 static std::atomic_ullong g_epoch{0};
-static std::vector<ThreadEpoch *> t_epoch_list{64, nullptr};
+static std::vector<ThreadEpoch *> t_epoch_list{MAX_EPOCH_THREADS, nullptr};
 static std::atomic_uint thread_num{0};
 static thread_local bool local_epoch_initialized = false;
 static thread_local ThreadEpoch my_epoch;
@@ -25,8 +28,12 @@ static void initialize_thread_epoch() {
     if (local_epoch_initialized == true) {
         return;
     }
-    t_epoch_list[thread_num.fetch_add(1, std::memory_order_relaxed)] =
-        &my_epoch;
+    auto index = thread_num.fetch_add(1, std::memory_order_relaxed);
+    if (index >= MAX_EPOCH_THREADS) {
+        thread_num.fetch_sub(1, std::memory_order_relaxed);
+        throw std::length_error("Too many threads use MPSCQueue");
+    }
+    t_epoch_list[index] = &my_epoch;
     local_epoch_initialized = true;
 }
 
@@ -117,8 +124,13 @@ template <typename T> inline void MPSCQueue<T>::retire(QueueNode<T> *node) {
 
 template <typename T> inline void MPSCQueue<T>::empty() {
     unsigned long long min_epoch = ULLONG_MAX;
-    for (auto i = 0; i < thread_num.load(std::memory_order_relaxed); ++i) {
+    const unsigned num = std::min(
+        thread_num.load(std::memory_order_relaxed), MAX_EPOCH_THREADS);
+    for (unsigned i = 0; i < num; ++i) {
 		auto thread_epoch = t_epoch_list[i];
+        // Counted but not stored yet, it has no node to protect.
+        if (thread_epoch == nullptr)
+            continue;
         auto epoch = thread_epoch->epoch.load(std::memory_order_acquire);
         if (epoch < min_epoch) {
             min_epoch = epoch;
@@ -0,0 +1,193 @@
+#include "name_directory.h"
+#include <functional>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+constexpr unsigned INVALID_HOLDER_ID = -1;
+
+NameDirectory::NameDirectory(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity * 2)
+        size <<= 1;
+    mask = size - 1;
+    slots.reset(new Slot[size]);
+}
+
+uint64_t NameDirectory::make_key(string_view name) {
+    return hash<string_view>{}(name) | (1ull << 63);
+}
+
+bool NameDirectory::is_same_name(const Slot &slot, string_view name) {
+    for (size_t i = 0; i < MAX_ID_LEN; ++i) {
+        auto c = slot.name[i].load(memory_order_relaxed);
+        if (i == name.size())
+            return c == '\0';
+        if (c != name[i])
+            return false;
+    }
+    return true;
+}
+
+void NameDirectory::set_name(Slot &slot, string_view name) {
+    for (size_t i = 0; i < MAX_ID_LEN; ++i)
+        slot.name[i].store(i < name.size() ? name[i] : '\0',
+                           memory_order_relaxed);
+}
+
+NameDirectory::Slot *NameDirectory::find_slot(string_view name,
+                                              uint64_t key) const {
+    for (size_t i = 0; i <= mask; ++i) {
+        Slot &slot = slots[(key + i) & mask];
+        auto slot_key = slot.key.load(memory_order_acquire);
+        while (slot_key == BUSY_KEY) {
+            this_thread::yield();
+            slot_key = slot.key.load(memory_order_acquire);
+        }
+        if (slot_key == EMPTY_KEY)
+            return nullptr;
+        // The key is read again since the name may have been rewritten.
+        if (slot_key == key && is_same_name(slot, name) &&
+            slot.key.load(memory_order_acquire) == key)
+            return &slot;
+    }
+    return nullptr;
+}
+
+NameDirectory::Insertion NameDirectory::insert(string_view name, uint64_t key,
+                                               uint64_t holder) {
+    lock_guard<mutex> lg{writer_lock};
+    Slot *reusable = nullptr;
+    for (size_t i = 0; i <= mask; ++i) {
+        Slot &slot = slots[(key + i) & mask];
+        auto slot_key = slot.key.load(memory_order_acquire);
+        if (slot_key == EMPTY_KEY) {
+            if (reusable != nullptr)
+                break;
+            set_name(slot, name);
+            slot.holder.store(holder, memory_order_release);
+            slot.key.store(key, memory_order_release);
+            return Insertion::Done;
+        }
+        if (slot_key == key && is_same_name(slot, name))
+            return Insertion::Raced;
+        if (reusable == nullptr &&
+            is_vacant(slot.holder.load(memory_order_acquire)))
+            reusable = &slot;
+    }
+    if (reusable == nullptr)
+        return Insertion::Full;
+
+    // Claims of the old name fail from here on.
+    auto old_holder = reusable->holder.load(memory_order_acquire);
+    if (!is_vacant(old_holder) ||
+        !reusable->holder.compare_exchange_strong(old_holder, UNLINKED))
+        return Insertion::Raced;
+    reusable->key.store(BUSY_KEY, memory_order_release);
+    reusable->generation.fetch_add(1, memory_order_relaxed);
+    set_name(*reusable, name);
+    reusable->key.store(key, memory_order_release);
+    reusable->holder.store(holder, memory_order_release);
+    return Insertion::Done;
+}
+
+// A vacant slot followed by an empty one is the last of every probe run
+// through it, so it can be emptied, and then so can a vacant one before it.
+void NameDirectory::trim(size_t index) {
+    while (slots[(index + 1) & mask].key.load(memory_order_acquire) ==
+           EMPTY_KEY) {
+        Slot &slot = slots[index];
+        auto holder = slot.holder.load(memory_order_acquire);
+        if (!is_vacant(holder) ||
+            !slot.holder.compare_exchange_strong(holder, UNLINKED))
+            return;
+        slot.key.store(EMPTY_KEY, memory_order_release);
+        slot.generation.fetch_add(1, memory_order_relaxed);
+        index = (index - 1) & mask;
+    }
+}
+
+optional<NameHolder> NameDirectory::claim(string_view name, unsigned id,
+                                          unsigned server_id) {
+    if (name.size() > MAX_ID_LEN)
+        return NameHolder{INVALID_HOLDER_ID, server_id};
+    const auto key = make_key(name);
+    while (true) {
+        auto slot = find_slot(name, key);
+        if (slot == nullptr) {
+            auto insertion = insert(name, key, pack(id, server_id));
+            if (insertion == Insertion::Done)
+                return nullopt;
+            if (insertion == Insertion::Full)
+                return NameHolder{INVALID_HOLDER_ID, server_id};
+            continue;
+        }
+
+        // A holder read after the slot was reused goes with its new key.
+        auto holder = slot->holder.load(memory_order_acquire);
+        if (holder == UNLINKED || slot->key.load(memory_order_acquire) != key)
+            continue;
+        if (is_held(holder) && unpack(holder).id != id)
+            return unpack(holder);
+        if (slot->holder.compare_exchange_strong(holder, pack(id, server_id)))
+            return nullopt;
+    }
+}
+
+void NameDirectory::force_claim(string_view name, unsigned id,
+                                unsigned server_id) {
+    if (name.size() > MAX_ID_LEN)
+        return;
+    const auto key = make_key(name);
+    while (true) {
+        auto slot = find_slot(name, key);
+        if (slot == nullptr) {
+            if (insert(name, key, pack(id, server_id)) != Insertion::Raced)
+                return;
+            continue;
+        }
+
+        auto holder = slot->holder.load(memory_order_acquire);
+        if (holder == UNLINKED || slot->key.load(memory_order_acquire) != key)
+            continue;
+        if (slot->holder.compare_exchange_strong(holder, pack(id, server_id)))
+            return;
+    }
+}
+
+bool NameDirectory::release(string_view name, unsigned id) {
+    if (name.size() > MAX_ID_LEN)
+        return false;
+    auto slot = find_slot(name, make_key(name));
+    if (slot == nullptr)
+        return false;
+
+    auto holder = slot->holder.load(memory_order_acquire);
+    while (is_held(holder) && unpack(holder).id == id) {
+        if (slot->holder.compare_exchange_weak(holder, vacant(*slot))) {
+            // Trimming is left to a later release when a writer is busy.
+            unique_lock<mutex> ul{writer_lock, try_to_lock};
+            if (ul.owns_lock())
+                trim(slot - slots.get());
+            return true;
+        }
+    }
+    return false;
+}
+
+bool NameDirectory::set_owner(string_view name, unsigned id,
+                              unsigned server_id) {
+    if (name.size() > MAX_ID_LEN)
+        return false;
+    auto slot = find_slot(name, make_key(name));
+    if (slot == nullptr)
+        return false;
+
+    auto holder = slot->holder.load(memory_order_acquire);
+    while (is_held(holder) && unpack(holder).id == id) {
+        if (slot->holder.compare_exchange_weak(holder, pack(id, server_id)))
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,85 @@
+#ifndef B7D29E41_0A6C_4F38_8E5B_93C1F4A6D207
+#define B7D29E41_0A6C_4F38_8E5B_93C1F4A6D207
+
+#include "protocol.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+
+struct NameHolder {
+    unsigned id;
+    unsigned server_id;
+};
+
+// Cluster-wide name -> id index.
+// Open addressing table that readers probe without any lock. A released
+// name only marks its slot vacant, and the holder is changed with CAS,
+// which makes a second login of the same name fail instead of overwriting
+// the first one. Adding a name takes the writer lock and reuses the first
+// vacant slot on its probe run, and a vacant slot that ends a run is
+// emptied again, so the table holds the live names and not every name
+// ever seen.
+class NameDirectory {
+  public:
+    explicit NameDirectory(size_t capacity);
+    NameDirectory(const NameDirectory &) = delete;
+    NameDirectory(NameDirectory &&) = delete;
+
+    // Returns the current holder when the name is held by another id.
+    // Returns nullopt on success. Fails with an INVALID id when full.
+    std::optional<NameHolder> claim(std::string_view name, unsigned id,
+                                    unsigned server_id);
+    // Overwrites the holder regardless of the current one.
+    void force_claim(std::string_view name, unsigned id, unsigned server_id);
+    bool release(std::string_view name, unsigned id);
+    bool set_owner(std::string_view name, unsigned id, unsigned server_id);
+
+  private:
+    static constexpr uint64_t EMPTY_KEY = 0;
+    static constexpr uint64_t BUSY_KEY = 1;
+    // Holder of a slot that is not a name right now. A vacant holder
+    // carries the generation of its slot, so a claim that read it before
+    // the slot was reused for another name fails its CAS.
+    static constexpr uint64_t UNLINKED = UINT64_MAX;
+    static constexpr uint64_t VACANT_BIT = 1ull << 63;
+
+    struct Slot {
+        std::atomic_uint64_t key{EMPTY_KEY};
+        // Rewritten when the slot is reused while readers may compare it.
+        std::atomic_char name[MAX_ID_LEN];
+        std::atomic_uint64_t holder{UNLINKED};
+        std::atomic_uint32_t generation{0};
+    };
+
+    enum class Insertion { Done, Raced, Full };
+
+    static uint64_t make_key(std::string_view name);
+    static uint64_t pack(unsigned id, unsigned server_id) {
+        return (uint64_t(server_id) << 32) | id;
+    }
+    static NameHolder unpack(uint64_t holder) {
+        return NameHolder{unsigned(holder), unsigned(holder >> 32)};
+    }
+    static uint64_t vacant(const Slot &slot) {
+        return VACANT_BIT | slot.generation.load(std::memory_order_relaxed);
+    }
+    static bool is_vacant(uint64_t holder) {
+        return (holder >> 32) == (VACANT_BIT >> 32);
+    }
+    static bool is_held(uint64_t holder) { return !(holder & VACANT_BIT); }
+
+    static bool is_same_name(const Slot &slot, std::string_view name);
+    static void set_name(Slot &slot, std::string_view name);
+    Slot *find_slot(std::string_view name, uint64_t key) const;
+    Insertion insert(std::string_view name, uint64_t key, uint64_t holder);
+    void trim(size_t index);
+
+    size_t mask;
+    std::unique_ptr<Slot[]> slots;
+    std::mutex writer_lock;
+};
+
+#endif /* B7D29E41_0A6C_4F38_8E5B_93C1F4A6D207 */
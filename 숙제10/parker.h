@@ -0,0 +1,126 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <optional>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+// Lets a consumer sleep until a producer has something for it. notify()
+// costs a fence and a load unless a consumer is actually parked.
+//
+// A consumer calls prepare_wait(), checks its condition once more, then
+// either cancel_wait() or wait() with the key it got.
+class Parker {
+  public:
+    Parker() = default;
+    Parker(const Parker &) = delete;
+    Parker(Parker &&) = delete;
+
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) == 0)
+            return;
+        notified_at.store(now(), std::memory_order_relaxed);
+        epoch.fetch_add(1, std::memory_order_seq_cst);
+#ifdef __linux__
+        syscall(SYS_futex, &epoch, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr,
+                nullptr, 0);
+#else
+        std::lock_guard<std::mutex> lg{lock};
+        cv.notify_all();
+#endif
+    }
+
+    uint32_t prepare_wait() {
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        return epoch.load(std::memory_order_seq_cst);
+    }
+
+    void cancel_wait() { waiters.fetch_sub(1, std::memory_order_relaxed); }
+
+    // Returns how long ago the waking notify() was, if one woke us.
+    std::optional<std::chrono::nanoseconds>
+    wait(uint32_t key, std::chrono::nanoseconds timeout) {
+#ifdef __linux__
+        auto secs = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+        timespec ts{time_t(secs.count()), long((timeout - secs).count())};
+        syscall(SYS_futex, &epoch, FUTEX_WAIT_PRIVATE, key, &ts, nullptr, 0);
+#else
+        std::unique_lock<std::mutex> lg{lock};
+        cv.wait_for(lg, timeout, [this, key]() {
+            return epoch.load(std::memory_order_seq_cst) != key;
+        });
+#endif
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        if (epoch.load(std::memory_order_acquire) == key)
+            return std::nullopt;
+        return std::chrono::nanoseconds{
+            now() - notified_at.load(std::memory_order_relaxed)};
+    }
+
+  private:
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    std::atomic<uint32_t> epoch{0};
+    std::atomic_uint waiters{0};
+    std::atomic<int64_t> notified_at{0};
+#ifndef __linux__
+    std::mutex lock;
+    std::condition_variable cv;
+#endif
+};
+
+struct WaitPolicy {
+    unsigned spin_count;
+    unsigned yield_count;
+};
+
+// Spins with pause, then yields, then parks on `parker` until `is_ready`
+// returns true or `timeout` passes while parked. Returns the wake up
+// latency when a notify() ended the park.
+template <typename F>
+std::optional<std::chrono::nanoseconds>
+wait_until(Parker &parker, const WaitPolicy &policy, F &&is_ready,
+           std::chrono::nanoseconds timeout = std::chrono::seconds{1}) {
+    for (unsigned i = 0; i < policy.spin_count; ++i) {
+        if (is_ready())
+            return std::nullopt;
+        cpu_relax();
+    }
+    for (unsigned i = 0; i < policy.yield_count; ++i) {
+        if (is_ready())
+            return std::nullopt;
+        std::this_thread::yield();
+    }
+
+    auto key = parker.prepare_wait();
+    if (is_ready()) {
+        parker.cancel_wait();
+        return std::nullopt;
+    }
+    return parker.wait(key, timeout);
+}
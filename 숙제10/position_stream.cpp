@@ -0,0 +1,52 @@
+#include "position_stream.h"
+#include <cstdlib>
+
+using namespace std;
+
+void PositionStream::put_varint(unsigned value) {
+    while (value >= 0x80) {
+        frame.emplace_back((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    frame.emplace_back(value);
+}
+
+void PositionStream::restart(unsigned char previous_epoch) {
+    lock_guard<mutex> lg{lock};
+    frame.clear();
+    entries.clear();
+    free_handles = {};
+    next_handle = 0;
+    epoch = previous_epoch + 1;
+}
+
+void PositionStream::encode(unsigned id, short x, short y) {
+    auto it = entries.find(id);
+    if (it == entries.end()) {
+        unsigned handle;
+        if (!free_handles.empty()) {
+            handle = free_handles.top();
+            free_handles.pop();
+        } else {
+            handle = next_handle++;
+        }
+        entries.emplace(id, Entry{handle, x, y});
+        put_varint(handle << 4 | POS_TAG_BIND);
+        put_varint(id);
+        put_varint(x);
+        put_varint(y);
+        return;
+    }
+
+    auto &entry = it->second;
+    int dx = x - entry.x, dy = y - entry.y;
+    entry.x = x;
+    entry.y = y;
+    if (abs(dx) > 1 || abs(dy) > 1) {
+        put_varint(entry.handle << 4 | POS_TAG_RESYNC);
+        put_varint(x);
+        put_varint(y);
+        return;
+    }
+    put_varint(entry.handle << 4 | (dx + 1) << 2 | (dy + 1));
+}
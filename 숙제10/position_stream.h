@@ -0,0 +1,107 @@
+#ifndef D3A8E5C1_27B4_4F0E_9C6A_5E1F08B7D342
+#define D3A8E5C1_27B4_4F0E_9C6A_5E1F08B7D342
+
+#include "protocol.h"
+#include <climits>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+// Compact position updates for one recipient, sent as sc_packet_pos_batch
+// frames once the client asks for them with cs_packet_compact_pos.
+//
+// Every entity the recipient hears about gets a small handle. An entry is a
+// varint of (handle << 4 | tag), where tag is
+//   (dx + 1) << 2 | (dy + 1)  for a step of -1, 0 or +1 on each axis,
+//   POS_TAG_RESYNC            followed by varint x and y,
+//   POS_TAG_BIND              followed by varint id, x and y.
+// So a step is one byte while the handle is below 8 and two below 1024.
+// Freed handles are reused lowest first to keep them there.
+//
+// A handle is bound to an id until a remove_object for that id or a frame
+// of a newer epoch. Each frame starts with the epoch of its stream. The
+// server that takes a client over restarts its stream at the next epoch,
+// so the client drops every binding when the epoch goes up, and drops
+// frames of an older epoch, which the previous owner sent before the
+// handover and may still be on their way.
+class PositionStream {
+  public:
+    static constexpr unsigned char POS_TAG_RESYNC = 3;
+    static constexpr unsigned char POS_TAG_BIND = 15;
+
+    PositionStream() = default;
+    PositionStream(const PositionStream &) = delete;
+    PositionStream(PositionStream &&) = delete;
+
+    // Queues a position of `id`. send_frame gets the epoch and the encoded
+    // body of each frame that fills up.
+    template <typename F>
+    void append(unsigned id, short x, short y, F &&send_frame) {
+        std::lock_guard<std::mutex> lg{lock};
+        if (frame.size() + MAX_ENTRY_SIZE > MAX_FRAME_BODY) {
+            send_frame(epoch, frame);
+            frame.clear();
+        }
+        encode(id, x, y);
+    }
+
+    template <typename F> void flush(F &&send_frame) {
+        std::lock_guard<std::mutex> lg{lock};
+        if (frame.empty())
+            return;
+        send_frame(epoch, frame);
+        frame.clear();
+    }
+
+    // Forgets every binding, for a client taken over from a stream of
+    // `previous_epoch`. Entries still queued are dropped with them.
+    void restart(unsigned char previous_epoch);
+
+    // Flushes first, so the recipient never sees the handle after the
+    // remove_object that frees it.
+    template <typename F> void forget(unsigned id, F &&send_frame) {
+        std::lock_guard<std::mutex> lg{lock};
+        if (!frame.empty()) {
+            send_frame(epoch, frame);
+            frame.clear();
+        }
+        auto it = entries.find(id);
+        if (it == entries.end())
+            return;
+        free_handles.push(it->second.handle);
+        entries.erase(it);
+    }
+
+    unsigned char current_epoch() {
+        std::lock_guard<std::mutex> lg{lock};
+        return epoch;
+    }
+
+  private:
+    struct Entry {
+        unsigned handle;
+        short x, y;
+    };
+
+    // Packet size is one byte, and the front end strips the id.
+    static constexpr unsigned MAX_FRAME_BODY = UCHAR_MAX -
+                                               sizeof(packet_header) -
+                                               sizeof(unsigned) -
+                                               sizeof(sc_packet_pos_batch);
+    static constexpr unsigned MAX_ENTRY_SIZE = 5 + 5 + 3 + 3;
+
+    void encode(unsigned id, short x, short y);
+    void put_varint(unsigned value);
+
+    std::mutex lock;
+    std::vector<unsigned char> frame;
+    std::unordered_map<unsigned, Entry> entries;
+    std::priority_queue<unsigned, std::vector<unsigned>, std::greater<unsigned>>
+        free_handles;
+    unsigned next_handle{0};
+    unsigned char epoch{0};
+};
+
+#endif /* D3A8E5C1_27B4_4F0E_9C6A_5E1F08B7D342 */
@@ -72,6 +72,26 @@ struct sc_packet_stat_change {
     int exp;
 };
 
+// Followed by PositionStream entries of other entities. An epoch is newer
+// when (signed char)(epoch - last) > 0.
+struct sc_packet_pos_batch {
+    using type = unsigned char;
+    static constexpr type type_num = 8;
+    unsigned char epoch;
+};
+
+struct sc_object_entry {
+    int id;
+    unsigned char o_type;
+    short x, y;
+};
+
+// Followed by sc_object_entry of entities around the client
+struct sc_packet_put_objects {
+    using type = unsigned char;
+    static constexpr type type_num = 9;
+};
+
 struct ss_packet_put {
     using type = unsigned char;
     static constexpr type type_num = 1;
@@ -104,9 +124,101 @@ struct ss_packet_hand_overed {
     unsigned id;
 };
 
-struct ss_packet_hand_over_started {
+struct ss_packet_name_claim {
+    using type = unsigned char;
+    static constexpr type type_num = 7;
+    unsigned id;
+    char name[MAX_ID_LEN];
+};
+
+struct ss_packet_name_release {
+    using type = unsigned char;
+    static constexpr type type_num = 8;
+    unsigned id;
+    char name[MAX_ID_LEN];
+};
+
+struct ss_packet_hand_over_state {
+    using type = unsigned char;
+    static constexpr type type_num = 9;
+    unsigned id;
+    short x, y;
+    char name[MAX_ID_LEN];
+    short hp;
+    short level;
+    int exp;
+    short hysteresis;
+    bool is_compact_pos;
+    unsigned char pos_epoch;
+    bool is_area_snapshot;
+};
+
+// Followed by the ids the client currently sees
+struct ss_packet_hand_over_view {
+    using type = unsigned char;
+    static constexpr type type_num = 10;
+    unsigned id;
+};
+
+// A shout of a client of the other server, for the clients of this one
+struct ss_packet_chat {
+    using type = unsigned char;
+    static constexpr type type_num = 11;
+    int id;
+    char chat[100];
+};
+
+// The row where the region of server 1 starts from now on. Ignored unless
+// `version` is above that of the last move taken
+struct ss_packet_move_seam {
     using type = unsigned char;
     static constexpr type type_num = 6;
+    short seam_y;
+    unsigned version;
+};
+
+// A player record for the db, which only server 0 keeps. A record restored
+// from a snapshot does not replace a newer one
+struct ss_packet_player_save {
+    using type = unsigned char;
+    static constexpr type type_num = 12;
+    char name[MAX_ID_LEN];
+    short x, y;
+    short hp;
+    short level;
+    int exp;
+    long long saved_at;
+    bool is_restored;
+};
+
+// Asks server 0 for the record of a player logging in to the other server
+struct ss_packet_player_load {
+    using type = unsigned char;
+    static constexpr type type_num = 13;
+    unsigned id;
+    char name[MAX_ID_LEN];
+};
+
+// The answer to ss_packet_player_load, the record fields only hold one when
+// `is_found`
+struct ss_packet_player_record {
+    using type = unsigned char;
+    static constexpr type type_num = 14;
+    unsigned id;
+    char name[MAX_ID_LEN];
+    bool is_found;
+    short x, y;
+    short hp;
+    short level;
+    int exp;
+};
+
+// The owner has logged the client out. The other server answers the front
+// end with sf_packet_logout_done once no ghost or proxy of the client is left
+// on it, and only then may the front end hand the index out again
+struct ss_packet_logout {
+    using type = unsigned char;
+    static constexpr type type_num = 15;
     unsigned id;
 };
 
@@ -116,9 +228,25 @@ struct ss_packet_hand_over_started {
 // - hand_over: server front-end ٸ server. ٸ  is_proxy ٲٰ, front-end   (  disconnect  ο  connect)
 // - forwarding_packet: ü  + forwarding_packet_type +  id +  Ŷ(size, type )
 
+struct fs_packet_hand_over_fence {
+    using type = unsigned char;
+    static constexpr type type_num = 11;
+};
+
+struct sf_packet_logout_done {
+    using type = unsigned char;
+    static constexpr type type_num = 12;
+};
+
+// Why a login was turned down
+constexpr unsigned char REJECT_NAME_TAKEN = 0;
+// The server is overloaded, the front end may try elsewhere or later
+constexpr unsigned char REJECT_BUSY = 1;
+
 struct sf_packet_reject_login {
     using type = unsigned char;
     static constexpr type type_num = 13;
+    unsigned char reason;
 };
 
 struct fs_packet_logout {
@@ -141,9 +269,12 @@ struct fs_packet_forwarding {
     static constexpr type type_num = 17;
 };
 
-struct message_hand_over_started {
+// Followed by `count` client ids, then one client packet the front end sends
+// to each of them
+struct sf_packet_multicast {
     using type = unsigned char;
     static constexpr type type_num = 18;
+    unsigned char count;
 };
 
 struct message_proxy_in {
@@ -168,12 +299,85 @@ struct message_hand_over_ended {
     static constexpr type type_num = 22;
 };
 
+struct message_kick {
+    using type = unsigned char;
+    static constexpr type type_num = 23;
+};
+
+struct message_hand_over_state {
+    using type = unsigned char;
+    static constexpr type type_num = 24;
+    short x, y;
+    char name[MAX_ID_LEN];
+    short hp;
+    short level;
+    int exp;
+    short hysteresis;
+    bool is_compact_pos;
+    unsigned char pos_epoch;
+    bool is_area_snapshot;
+};
+
+// Followed by the client packets forwarded by the previous owner
+struct message_forwarded {
+    using type = unsigned char;
+    static constexpr type type_num = 25;
+};
+
+// Followed by ids the client saw on the previous owner
+struct message_hand_over_view {
+    using type = unsigned char;
+    static constexpr type type_num = 26;
+};
+
+// The seam has moved, the client may now be in the edge or in the region of
+// the other server
+struct message_seam_moved {
+    using type = unsigned char;
+    static constexpr type type_num = 27;
+};
+
+// Saves the client from its own job, which is the only one to touch its
+// fields
+struct message_save {
+    using type = unsigned char;
+    static constexpr type type_num = 28;
+};
+
+// Adds the client to the world snapshot of `round` from its own job
+struct message_snapshot {
+    using type = unsigned char;
+    static constexpr type type_num = 29;
+    unsigned round;
+};
+
+// Ends the login of the client with its record from the db of server 0
+struct message_player_loaded {
+    using type = unsigned char;
+    static constexpr type type_num = 30;
+    char name[MAX_ID_LEN];
+    bool is_found;
+    short x, y;
+    short hp;
+    short level;
+    int exp;
+};
+
 struct cs_packet_login {
     using type = unsigned char;
     static constexpr type type_num = 1;
     char id[MAX_ID_LEN];
 };
 
+// Takes sc_packet_put_objects instead of one sc_packet_put_object per entity
+// on login and handover
+constexpr unsigned char LOGIN_AREA_SNAPSHOT = 1;
+
+// Optional byte after cs_packet_login, older clients leave it out
+struct cs_login_features {
+    unsigned char flags;
+};
+
 constexpr unsigned char D_UP = 0;
 constexpr unsigned char D_DOWN = 1;
 constexpr unsigned char D_LEFT = 2;
@@ -207,4 +411,25 @@ struct cs_packet_teleport {
     static constexpr type type_num = 6;
 };
 
+// Asks for sc_packet_pos_batch instead of sc_packet_pos for other entities
+struct cs_packet_compact_pos {
+    using type = unsigned char;
+    static constexpr type type_num = 7;
+};
+
+// Moves the client into an instanced area of its server, 0 leads back to
+// where it left the world
+struct cs_packet_enter_instance {
+    using type = unsigned char;
+    static constexpr type type_num = 8;
+    int instance;
+};
+
+// A chat heard by every client of every server, not only of this area
+struct cs_packet_shout {
+    using type = unsigned char;
+    static constexpr type type_num = 9;
+    char chat_str[100];
+};
+
 #pragma pack(pop)
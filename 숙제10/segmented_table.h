@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// Fixed capacity array whose elements live in segments allocated on first
+// touch, so a large capacity only costs one pointer per segment until it is
+// actually used. Elements never move once their segment exists.
+template <typename T, unsigned SEGMENT_BITS = 12> class SegmentedTable {
+  public:
+    static constexpr size_t SEGMENT_SIZE = size_t(1) << SEGMENT_BITS;
+
+    explicit SegmentedTable(size_t capacity)
+        : segments{new std::atomic<T *>[(capacity + SEGMENT_SIZE - 1) /
+                                        SEGMENT_SIZE]},
+          num_segments{(capacity + SEGMENT_SIZE - 1) / SEGMENT_SIZE} {
+        for (size_t i = 0; i < num_segments; ++i)
+            segments[i].store(nullptr, std::memory_order_relaxed);
+    }
+    ~SegmentedTable() {
+        for (size_t i = 0; i < num_segments; ++i)
+            delete[] segments[i].load(std::memory_order_relaxed);
+    }
+    SegmentedTable(const SegmentedTable &) = delete;
+    SegmentedTable(SegmentedTable &&) = delete;
+
+    size_t capacity() const { return num_segments * SEGMENT_SIZE; }
+
+    T &operator[](size_t index) {
+        auto &segment = segments[index >> SEGMENT_BITS];
+        T *elements = segment.load(std::memory_order_acquire);
+        if (elements == nullptr)
+            elements = install(segment);
+        return elements[index & (SEGMENT_SIZE - 1)];
+    }
+
+    size_t allocated_segments() const {
+        size_t count = 0;
+        for (size_t i = 0; i < num_segments; ++i)
+            if (segments[i].load(std::memory_order_relaxed) != nullptr)
+                ++count;
+        return count;
+    }
+
+  private:
+    // Two threads may race to allocate the same segment, the loser frees
+    // its copy.
+    T *install(std::atomic<T *> &segment) {
+        T *fresh = new T[SEGMENT_SIZE]{};
+        T *expected = nullptr;
+        if (segment.compare_exchange_strong(expected, fresh,
+                                            std::memory_order_acq_rel))
+            return fresh;
+        delete[] fresh;
+        return expected;
+    }
+
+    std::unique_ptr<std::atomic<T *>[]> segments;
+    const size_t num_segments;
+};
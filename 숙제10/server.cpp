@@ -1,54 +1,256 @@
 #include "server.h"
+#include "entity_table.h"
+#include "id_allocator.h"
+#include "log.h"
 #include "protocol.h"
+#include "segmented_table.h"
 #include "util.h"
+#include <algorithm>
+#include <array>
+#include <functional>
 #include <iostream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
 #include <thread>
 #include <vector>
 
 using namespace std;
 
-constexpr unsigned MAX_USER_NUM = 20000;
+constexpr unsigned MAX_USER_NUM = 1 << 18;
 constexpr unsigned INVALID_ID = -1;
 constexpr unsigned VIEW_RANGE = 7;
-constexpr unsigned EDGE_RANGE = 4;
+constexpr int EDGE_RANGE = 4;
 constexpr unsigned BUFFER_RANGE = 2;
+// Steps patched from a strip scan before the view is rebuilt from a full one.
+// Two clients stepping toward each other on different workers can each miss
+// the other in their strips, the rebuild finds them.
+constexpr unsigned FULL_VIEW_STEPS = 8;
+
+static SegmentedTable<ClientSlot> clients{MAX_USER_NUM};
+static IdAllocator live_ids{MAX_USER_NUM};
+static EntityTable entities{MAX_USER_NUM};
+// First row of the region of server 1. Moved by the operator, see move_seam.
+static atomic<short> seam_y{WORLD_HEIGHT / 2};
+
+ClientSlot &slot_of(unsigned id) { return clients[id_index(id)]; }
+
+// Names are capped at login to leave room for the terminator, packets and
+// records are not zeroed so it is always written.
+static void copy_name(char (&to)[MAX_ID_LEN], const string &name) {
+    auto len = min(name.size(), size_t(MAX_ID_LEN - 1));
+    memcpy(to, name.data(), len);
+    to[len] = '\0';
+}
+
+// A chat from a client may be shorter than the array it is read as, so only
+// `size` bytes of it are read.
+template <size_t N>
+static void copy_chat(char (&to)[N], const char *mess, size_t size) {
+    auto len = strnlen(mess, min(size, N - 1));
+    memcpy(to, mess, len);
+    memset(to + len, 0, N - len);
+}
+
+// Freed handover states are kept for the next client that hands over, up to
+// a bound so a burst of handovers does not pin its memory forever.
+constexpr size_t MAX_POOLED_HAND_OVER_STATES = 1024;
+static mutex hand_over_pool_lock;
+static vector<HandOverState *> hand_over_pool;
+
+HandOverState *acquire_hand_over_state() {
+    {
+        lock_guard<mutex> lg{hand_over_pool_lock};
+        if (!hand_over_pool.empty()) {
+            auto state = hand_over_pool.back();
+            hand_over_pool.pop_back();
+            return state;
+        }
+    }
+    return new HandOverState;
+}
+
+void release_hand_over_state(HandOverState *state) {
+    state->pending_packets.for_each([](auto) {});
+    state->view.clear();
+    state->stall_started_at.store(0, memory_order_relaxed);
+
+    lock_guard<mutex> lg{hand_over_pool_lock};
+    if (hand_over_pool.size() < MAX_POOLED_HAND_OVER_STATES)
+        hand_over_pool.emplace_back(state);
+    else
+        delete state;
+}
+
+// The SOCKETINFO of a recycled id may still be in use by a job, a scan or a
+// handler that found it before the id moved on. Threads touching clients
+// announce the epoch they started in while they do, and a replaced SOCKETINFO
+// is only deleted once every thread has left the epoch it was retired in.
+constexpr unsigned MAX_CLIENT_THREADS = 64;
+struct alignas(64) ClientEpoch {
+    atomic_ullong epoch{ULLONG_MAX};
+};
+static atomic_ullong client_epoch{0};
+static array<ClientEpoch, MAX_CLIENT_THREADS> client_epochs;
+static atomic_uint num_client_threads{0};
+static mutex retired_clients_lock;
+static vector<pair<SOCKETINFO *, unsigned long long>> retired_clients;
+
+ClientEpoch &client_epoch_of_this_thread() {
+    thread_local ClientEpoch *mine = nullptr;
+    if (mine == nullptr) {
+        auto index = num_client_threads.fetch_add(1);
+        if (index >= MAX_CLIENT_THREADS)
+            throw runtime_error("Too many threads touch clients");
+        mine = &client_epochs[index];
+    }
+    return *mine;
+}
+
+// Keeps every SOCKETINFO this thread can reach alive while it exists.
+// Nested guards leave the outermost one in charge.
+class ClientGuard {
+  public:
+    ClientGuard() : mine{client_epoch_of_this_thread()} {
+        is_outermost = mine.epoch.load(memory_order_relaxed) == ULLONG_MAX;
+        if (is_outermost)
+            mine.epoch.store(client_epoch.load());
+    }
+    ~ClientGuard() {
+        if (is_outermost)
+            mine.epoch.store(ULLONG_MAX, memory_order_release);
+    }
+    ClientGuard(const ClientGuard &) = delete;
+
+  private:
+    ClientEpoch &mine;
+    bool is_outermost;
+};
+
+void retire_client(SOCKETINFO *client) {
+    lock_guard<mutex> lg{retired_clients_lock};
+    retired_clients.emplace_back(client, client_epoch.fetch_add(1));
+
+    auto min_epoch = ULLONG_MAX;
+    for (unsigned i = 0; i < num_client_threads.load(); ++i)
+        min_epoch = min(min_epoch, client_epochs[i].epoch.load());
+    auto freed = remove_if(retired_clients.begin(), retired_clients.end(),
+                           [min_epoch](auto &retired) {
+                               if (retired.second >= min_epoch)
+                                   return false;
+                               delete retired.first;
+                               return true;
+                           });
+    retired_clients.erase(freed, retired_clients.end());
+}
+
+// Runs func only when the slot still holds this generation of the id.
+template <typename F> void with_client(unsigned id, F &&func) {
+    auto &slot = slot_of(id);
+    if (slot.holds(id))
+        func(*slot.get());
+}
+
+void set_position(SOCKETINFO &cl, short x, short y) {
+    cl.x = x;
+    cl.y = y;
+    if (cl.instance != nullptr)
+        cl.instance->set_position(cl.instance_row, x, y);
+    else
+        entities.set_position(id_index(cl.id), x, y);
+}
+
+void set_logged_in(SOCKETINFO &cl, bool is_logged_in) {
+    cl.is_logged_in = is_logged_in;
+    if (is_logged_in)
+        entities.add_flags(id_index(cl.id), ENTITY_LOGGED_IN);
+    else
+        entities.clear_flags(id_index(cl.id), ENTITY_LOGGED_IN);
+}
+
+void set_proxy(SOCKETINFO &cl, bool is_proxy) {
+    cl.is_proxy = is_proxy;
+    if (is_proxy)
+        entities.add_flags(id_index(cl.id), ENTITY_PROXY);
+    else
+        entities.clear_flags(id_index(cl.id), ENTITY_PROXY);
+}
 
-static ClientSlot clients[MAX_USER_NUM];
-static atomic_uint user_num{0};
+void activate_slot(ClientSlot &slot, SOCKETINFO *player) {
+    const auto index = id_index(player->id);
+    if (auto previous = slot.ptr.exchange(player, memory_order_acq_rel))
+        retire_client(previous);
+    entities.set_id(index, player->id);
+    entities.set_position(index, player->x, player->y);
+    entities.set_flags(index, ENTITY_ACTIVE |
+                                  (player->is_proxy ? ENTITY_PROXY : 0));
+    slot.is_active.store(true, memory_order_release);
+    live_ids.acquire(player->id);
+}
 
-enum MoveType { None, EnterToEdge, LeaveFromBuffer, HandOver };
+// Ids of every logged in entity in the view range of (x, y).
+vector<unsigned> find_near(short x, short y) {
+    vector<unsigned> near_ids;
+    entities.query_near(x, y, VIEW_RANGE, ENTITY_ACTIVE | ENTITY_LOGGED_IN,
+                        live_ids.bound(), near_ids);
+    return near_ids;
+}
 
-MoveType check_move_type(short old_y, short new_y, unsigned server_id) {
+// Leaving the edge and handing over need the move to head that way and to
+// get `extra` tiles further than the bands.
+MoveType check_move_type(short old_y, short new_y, unsigned server_id,
+                         short extra) {
+    const short seam = seam_y.load(memory_order_relaxed);
     short buffer_y, other_buffer_y;
     if (server_id == 0) {
-        buffer_y = WORLD_HEIGHT / 2 - (EDGE_RANGE + BUFFER_RANGE);
-        other_buffer_y = WORLD_HEIGHT / 2 + (EDGE_RANGE + BUFFER_RANGE - 1);
+        buffer_y = seam - (EDGE_RANGE + BUFFER_RANGE);
+        other_buffer_y = seam + (EDGE_RANGE + BUFFER_RANGE - 1);
         if (old_y < (buffer_y + BUFFER_RANGE) &&
             (buffer_y + BUFFER_RANGE) <= new_y)
             return EnterToEdge;
-        if (buffer_y <= old_y && new_y < buffer_y)
+        if (new_y < old_y && new_y < buffer_y - extra)
             return LeaveFromBuffer;
-        if (old_y <= other_buffer_y && other_buffer_y < new_y)
+        if (old_y < new_y && other_buffer_y + extra < new_y)
             return HandOver;
     } else {
-        buffer_y = WORLD_HEIGHT / 2 + (EDGE_RANGE + BUFFER_RANGE - 1);
-        other_buffer_y = WORLD_HEIGHT / 2 - (EDGE_RANGE + BUFFER_RANGE);
+        buffer_y = seam + (EDGE_RANGE + BUFFER_RANGE - 1);
+        other_buffer_y = seam - (EDGE_RANGE + BUFFER_RANGE);
         if ((buffer_y - BUFFER_RANGE) < old_y &&
             new_y <= (buffer_y - BUFFER_RANGE))
             return EnterToEdge;
-        if (old_y <= buffer_y && buffer_y < new_y)
+        if (old_y < new_y && buffer_y + extra < new_y)
             return LeaveFromBuffer;
-        if (other_buffer_y <= old_y && new_y < other_buffer_y)
+        if (new_y < old_y && new_y < other_buffer_y - extra)
             return HandOver;
     }
 
     return None;
 }
 
+// Rows [first, second) of the region of the server.
+pair<short, short> region_of(unsigned server_id) {
+    const short seam = seam_y.load(memory_order_relaxed);
+    if (server_id == 0)
+        return {0, seam};
+    return {seam, WORLD_HEIGHT};
+}
+
 pair<unsigned, unsigned> make_random_position(unsigned server_id) {
-    return pair(fast_rand() % WORLD_WIDTH,
-                server_id * (WORLD_HEIGHT / 2) +
-                    (fast_rand() % (WORLD_HEIGHT / 2)));
+    auto [top, bottom] = region_of(server_id);
+    return pair(fast_rand() % WORLD_WIDTH, top + fast_rand() % (bottom - top));
+}
+
+bool is_in_region(short y, unsigned server_id) {
+    auto [top, bottom] = region_of(server_id);
+    return top <= y && y < bottom;
+}
+
+bool check_in_edge(short y, unsigned server_id) {
+    const short seam = seam_y.load(memory_order_relaxed);
+    if (server_id == 0)
+        return y >= seam - EDGE_RANGE;
+    else
+        return y < seam + EDGE_RANGE;
 }
 
 bool is_near(int x1, int y1, int x2, int y2) {
@@ -59,12 +261,6 @@ bool is_near(int x1, int y1, int x2, int y2) {
     return true;
 }
 
-void handle_send(const boost_error &error, const size_t length) {
-    if (error) {
-        cerr << "Error at send: " << error.message() << endl;
-    }
-}
-
 template <typename F>
 void assemble_packet(unsigned char *recv_buf, size_t &prev_packet_size,
                      size_t received_bytes, F &&packet_handler) {
@@ -112,10 +308,7 @@ unique_ptr<unsigned char[]> make_message(unsigned id, F &&func) {
 }
 
 template <typename P, typename F>
-pair<unsigned char *, size_t> make_packet(SOCKETINFO &user, F &&func) {
-
-    if (user_num <= 0)
-        return make_pair(nullptr, 0);
+pair<unsigned char *, size_t> make_packet(unsigned id, F &&func) {
 
     unsigned packet_offset =
         sizeof(packet_header) + sizeof(unsigned);
@@ -127,34 +320,68 @@ pair<unsigned char *, size_t> make_packet(SOCKETINFO &user, F &&func) {
     header->type = P::type_num;
 
     unsigned *user_id = (unsigned *)(packet + sizeof(packet_header));
-    *user_id = user.id;
+    *user_id = id;
 
     func(*(P *)(packet + packet_offset));
     return make_pair(packet, total_size);
 }
 
 template <typename P, typename F>
-void send_packet(SOCKETINFO &client, F &&packet_maker_func) {
-    auto [packet, total_size] =
-        make_packet<P>(client, move(packet_maker_func));
+void send_packet(LinkWriter &link, unsigned id, F &&packet_maker_func,
+                 LinkWriter::Lane lane = lane_of<P>) {
+    auto [packet, total_size] = make_packet<P>(id, move(packet_maker_func));
 
-    if (packet == nullptr)
-        return;
+    link.send(unique_ptr<unsigned char[]>{packet}, lane);
+}
+
+void send_pos_frame(SOCKETINFO &client, unsigned char epoch,
+                    const vector<unsigned char> &body) {
+    constexpr unsigned header_size = sizeof(packet_header) + sizeof(unsigned) +
+                                     sizeof(sc_packet_pos_batch);
+    unsigned total_size = header_size + body.size();
+    unique_ptr<unsigned char[]> packet{new unsigned char[total_size]};
+    packet_header *header = (packet_header *)packet.get();
+    header->size = total_size;
+    header->type = sc_packet_pos_batch::type_num;
+    *(unsigned *)(header + 1) = client.id;
+    ((sc_packet_pos_batch *)(packet.get() + sizeof(packet_header) +
+                             sizeof(unsigned)))
+        ->epoch = epoch;
+    memcpy(packet.get() + header_size, body.data(), body.size());
+
+    client.link.send(move(packet), LinkWriter::Bulk);
+}
 
-    client.sock.async_send(buffer(packet, total_size),
-                              [packet](auto error, auto length) {
-                                  delete[] packet;
-                                  handle_send(error, length);
-                              });
+void flush_positions(SOCKETINFO &client) {
+    if (auto stream = client.position_stream.load(memory_order_acquire))
+        stream->flush([&client](auto epoch, auto &body) {
+            send_pos_frame(client, epoch, body);
+        });
 }
 
+// Recipients this thread queued compact positions for. They are flushed
+// once the current job is done, so one frame carries many updates.
+static thread_local vector<unsigned> pending_pos_recipients;
+
+// Anything else sent to a client goes after its queued positions.
 template <typename P, typename F>
-void send_packet(int id, F &&packet_maker_func) {
-    auto &client_slot = clients[id];
-    if (!client_slot)
-        return;
+void send_packet(SOCKETINFO &client, F &&packet_maker_func,
+                 LinkWriter::Lane lane = lane_of<P>) {
+    flush_positions(client);
+    send_packet<P>(client.link, client.id, move(packet_maker_func), lane);
+}
 
-    send_packet<P>(*client_slot.ptr, move(packet_maker_func));
+void deactivate_slot(ClientSlot &slot) {
+    auto client = slot.get();
+    client->is_logged_in = false;
+    entities.set_flags(id_index(client->id), 0);
+    // Ordered against the ss_packet_logout handler, which sets the flag and
+    // then looks at the slot, so one of the two answers the front end.
+    slot.is_active.store(false);
+    live_ids.release(client->id);
+    if (client->is_logged_out.load())
+        send_packet<sf_packet_logout_done>(client->link, client->id,
+                                           [](sf_packet_logout_done &) {});
 }
 
 void send_login_ok_packet(SOCKETINFO &client, unsigned id) {
@@ -162,9 +389,9 @@ void send_login_ok_packet(SOCKETINFO &client, unsigned id) {
         packet.id = id;
         packet.x = client.x;
         packet.y = client.y;
-        packet.hp = 100;
-        packet.level = 1;
-        packet.exp = 1;
+        packet.hp = client.hp;
+        packet.level = client.level;
+        packet.exp = client.exp;
     };
     if (!client.is_proxy)
         send_packet<sc_packet_login_ok>(client, maker);
@@ -175,12 +402,13 @@ void send_login_fail(SOCKETINFO &client) {
                                       [](sc_packet_login_fail &packet) {});
 }
 
-void send_put_object_packet(SOCKETINFO &client, SOCKETINFO &new_client) {
-    auto maker = [&new_client](sc_packet_put_object &packet) {
-        packet.id = new_client.id;
-        packet.x = new_client.x;
-        packet.y = new_client.y;
-        if (new_client.is_proxy) {
+void send_put_object_packet(SOCKETINFO &client, unsigned id, short x, short y,
+                            bool is_proxy) {
+    auto maker = [id, x, y, is_proxy](sc_packet_put_object &packet) {
+        packet.id = id;
+        packet.x = x;
+        packet.y = y;
+        if (is_proxy) {
             packet.o_type = 2;
         } else {
             packet.o_type = 1;
@@ -191,11 +419,83 @@ void send_put_object_packet(SOCKETINFO &client, SOCKETINFO &new_client) {
     }
 }
 
-void send_pos_packet(SOCKETINFO &client, SOCKETINFO &mover) {
-    auto maker = [&mover, &client](sc_packet_pos &packet) {
-        packet.id = mover.id;
-        packet.x = mover.x;
-        packet.y = mover.y;
+void send_put_object_packet(SOCKETINFO &client, SOCKETINFO &new_client) {
+    send_put_object_packet(client, new_client.id, new_client.x, new_client.y,
+                           new_client.is_proxy);
+}
+
+// Puts of one area query for a client, as sc_packet_put_objects frames if
+// the client asked for them.
+class PutObjectBatch {
+  public:
+    explicit PutObjectBatch(SOCKETINFO &client) : client{client} {}
+    PutObjectBatch(const PutObjectBatch &) = delete;
+    ~PutObjectBatch() { flush(); }
+
+    void add(unsigned id, short x, short y, bool is_proxy) {
+        if (!client.is_area_snapshot) {
+            send_put_object_packet(client, id, x, y, is_proxy);
+            return;
+        }
+        if (entries.size() == MAX_ENTRIES)
+            flush();
+        entries.push_back(sc_object_entry{int(id),
+                                          (unsigned char)(is_proxy ? 2 : 1),
+                                          x, y});
+    }
+    void add(SOCKETINFO &other) {
+        add(other.id, other.x, other.y, other.is_proxy);
+    }
+
+    void flush() {
+        if (entries.empty())
+            return;
+        if (client.is_proxy) {
+            entries.clear();
+            return;
+        }
+        flush_positions(client);
+
+        constexpr unsigned header_size =
+            sizeof(packet_header) + sizeof(unsigned);
+        const unsigned entries_size = entries.size() * sizeof(sc_object_entry);
+        const unsigned total_size = header_size + entries_size;
+        unique_ptr<unsigned char[]> packet{new unsigned char[total_size]};
+        packet_header *header = (packet_header *)packet.get();
+        header->size = total_size;
+        header->type = sc_packet_put_objects::type_num;
+        *(unsigned *)(header + 1) = client.id;
+        memcpy(packet.get() + header_size, entries.data(), entries_size);
+        entries.clear();
+
+        client.link.send(move(packet), LinkWriter::Bulk);
+    }
+
+  private:
+    // The front end strips the id before the client sees it.
+    static constexpr unsigned MAX_ENTRIES =
+        (UCHAR_MAX - sizeof(packet_header) - sizeof(unsigned)) /
+        sizeof(sc_object_entry);
+
+    SOCKETINFO &client;
+    vector<sc_object_entry> entries;
+};
+
+void send_pos_packet(SOCKETINFO &client, unsigned id, short x, short y) {
+    // Its own position keeps the full packet, which carries move_time.
+    auto stream = client.position_stream.load(memory_order_acquire);
+    if (stream != nullptr && id != client.id && !client.is_proxy) {
+        stream->append(id, x, y, [&client](auto epoch, auto &body) {
+            send_pos_frame(client, epoch, body);
+        });
+        pending_pos_recipients.emplace_back(client.id);
+        return;
+    }
+
+    auto maker = [id, x, y, &client](sc_packet_pos &packet) {
+        packet.id = id;
+        packet.x = x;
+        packet.y = y;
         packet.move_time = client.move_time;
     };
     if (!client.is_proxy) {
@@ -203,78 +503,328 @@ void send_pos_packet(SOCKETINFO &client, SOCKETINFO &mover) {
     }
 }
 
-void send_remove_object_packet(SOCKETINFO &client, SOCKETINFO &leaver) {
-    auto maker = [&leaver](sc_packet_remove_object &packet) {
-        packet.id = leaver.id;
-    };
+void send_pos_packet(SOCKETINFO &client, SOCKETINFO &mover) {
+    send_pos_packet(client, mover.id, mover.x, mover.y);
+}
+
+void send_remove_object_packet(SOCKETINFO &client, unsigned id) {
+    auto maker = [id](sc_packet_remove_object &packet) { packet.id = id; };
+
+    if (auto stream = client.position_stream.load(memory_order_acquire))
+        stream->forget(id, [&client](auto epoch, auto &body) {
+            send_pos_frame(client, epoch, body);
+        });
 
     if (!client.is_proxy) {
         send_packet<sc_packet_remove_object>(client, maker);
     }
 }
 
-void send_chat_packet(SOCKETINFO &client, int teller, char *mess) {
-    auto maker = [teller, mess](sc_packet_chat &packet) {
-        packet.id = teller;
-        strcpy(packet.chat, mess);
-    };
-    if (!client.is_proxy)
-        send_packet<sc_packet_chat>(client, maker);
+void send_remove_object_packet(SOCKETINFO &client, SOCKETINFO &leaver) {
+    send_remove_object_packet(client, leaver.id);
 }
-bool Server::ProcessMove(SOCKETINFO &client, short new_x, short new_y,
-                         unsigned move_time) {
-    MoveType move_type = check_move_type(client.y, new_y, server_id);
 
-    client.x = new_x;
-    client.y = new_y;
+using ChatPacket =
+    array<unsigned char, sizeof(packet_header) + sizeof(sc_packet_chat)>;
+
+ChatPacket make_chat_packet(int teller, const char *mess, size_t size) {
+    ChatPacket packet;
+    packet_header *header = (packet_header *)packet.data();
+    header->size = packet.size();
+    header->type = sc_packet_chat::type_num;
+    sc_packet_chat *chat = (sc_packet_chat *)(header + 1);
+    chat->id = teller;
+    copy_chat(chat->chat, mess, size);
+    return packet;
+}
 
-    send_pos_packet(client, client);
+// Sends one client packet to many clients. It is copied into one
+// sf_packet_multicast frame per as many ids as fit, the frames are staged
+// together, and the front end fans each of them out.
+void send_multicast(LinkWriter &link, const unsigned char *packet,
+                    const vector<unsigned> &ids) {
+    constexpr unsigned frame_header_size = sizeof(packet_header) +
+                                           sizeof(unsigned) +
+                                           sizeof(sf_packet_multicast);
+    const unsigned packet_size = packet[0];
+    const unsigned max_ids_per_frame =
+        (UCHAR_MAX - frame_header_size - packet_size) / sizeof(unsigned);
+    if (ids.empty())
+        return;
 
-    auto old_view_list = client.copy_view_list();
+    const size_t num_frames =
+        (ids.size() + max_ids_per_frame - 1) / max_ids_per_frame;
+    const size_t total_size = num_frames * (frame_header_size + packet_size) +
+                              ids.size() * sizeof(unsigned);
+    unique_ptr<unsigned char[]> frames{new unsigned char[total_size]};
+    unsigned char *p = frames.get();
+    for (size_t first = 0; first < ids.size(); first += max_ids_per_frame) {
+        unsigned count = min<size_t>(ids.size() - first, max_ids_per_frame);
+        unsigned frame_size =
+            frame_header_size + count * sizeof(unsigned) + packet_size;
+        packet_header *header = (packet_header *)p;
+        header->size = frame_size;
+        header->type = sf_packet_multicast::type_num;
+        *(unsigned *)(header + 1) = INVALID_ID;
+        ((sf_packet_multicast *)(p + sizeof(packet_header) + sizeof(unsigned)))
+            ->count = count;
+        memcpy(p + frame_header_size, ids.data() + first,
+               count * sizeof(unsigned));
+        memcpy(p + frame_header_size + count * sizeof(unsigned), packet,
+               packet_size);
+        p += frame_size;
+    }
+    link.send(move(frames), total_size, LinkWriter::Bulk);
+}
+void flush_pending_positions() {
+    sort(pending_pos_recipients.begin(), pending_pos_recipients.end());
+    pending_pos_recipients.erase(unique(pending_pos_recipients.begin(),
+                                        pending_pos_recipients.end()),
+                                 pending_pos_recipients.end());
+    for (auto id : pending_pos_recipients)
+        with_client(id, [](SOCKETINFO &cl) { flush_positions(cl); });
+    pending_pos_recipients.clear();
+}
 
-    set<unsigned> new_view_list;
+void enable_compact_pos(SOCKETINFO &cl) {
+    if (cl.position_stream.load(memory_order_relaxed) == nullptr)
+        cl.position_stream.store(new PositionStream, memory_order_release);
+}
 
-    for (auto i = 0; i < user_num.load(memory_order_relaxed); ++i) {
-        clients[i].then([&client, &new_view_list](auto &cl) {
-            if (client.id != cl.id && is_near(cl.x, cl.y, client.x, client.y) &&
-                cl.is_logged_in) {
-                new_view_list.emplace(cl.id);
-            }
-        });
+// A ghost is an entity of the other server replicated across the seam. It
+// is only a row of the entity table, updated in place by the io thread, with
+// no SOCKETINFO or worker scheduling behind it.
+bool is_ghost(unsigned id) {
+    const auto index = id_index(id);
+    return entities.has_flags(index, ENTITY_GHOST) && entities.id(index) == id;
+}
+
+void put_ghost(unsigned id, short x, short y) {
+    const auto index = id_index(id);
+    entities.set_id(index, id);
+    entities.set_position(index, x, y);
+    entities.set_flags(index, ENTITY_ACTIVE | ENTITY_LOGGED_IN |
+                                  ENTITY_PROXY | ENTITY_GHOST);
+    live_ids.acquire(id);
+}
+
+void remove_ghost(unsigned id) {
+    entities.set_flags(id_index(id), 0);
+    live_ids.release(id);
+}
+
+void send_put_ghost_packet(SOCKETINFO &client, unsigned id) {
+    const auto index = id_index(id);
+    send_put_object_packet(client, id, entities.x(index), entities.y(index),
+                           true);
+}
+
+void send_put_ghost_packet(PutObjectBatch &batch, unsigned id) {
+    const auto index = id_index(id);
+    batch.add(id, entities.x(index), entities.y(index), true);
+}
+
+struct Position {
+    short x, y;
+};
+
+// Ghosts keep no view list, whether a client sees one follows from their
+// distance. Tells the clients around a ghost what changed when it appeared,
+// moved or left.
+void update_ghost_view(unsigned id, optional<Position> old_pos,
+                       optional<Position> new_pos) {
+    vector<unsigned> near_ids;
+    if (old_pos && new_pos && abs(new_pos->x - old_pos->x) <= VIEW_RANGE &&
+        abs(new_pos->y - old_pos->y) <= VIEW_RANGE) {
+        // The two view squares overlap, so one scan of the box around both
+        // finds every client that saw or sees the ghost. The corners it
+        // adds are skipped below.
+        entities.query_rect(min(old_pos->x, new_pos->x) - VIEW_RANGE,
+                            max(old_pos->x, new_pos->x) + VIEW_RANGE,
+                            min(old_pos->y, new_pos->y) - VIEW_RANGE,
+                            max(old_pos->y, new_pos->y) + VIEW_RANGE,
+                            ENTITY_ACTIVE | ENTITY_LOGGED_IN, live_ids.bound(),
+                            near_ids);
+    } else {
+        if (old_pos)
+            near_ids = find_near(old_pos->x, old_pos->y);
+        if (new_pos) {
+            auto new_near_ids = find_near(new_pos->x, new_pos->y);
+            near_ids.insert(near_ids.end(), new_near_ids.begin(),
+                            new_near_ids.end());
+            sort(near_ids.begin(), near_ids.end());
+            near_ids.erase(unique(near_ids.begin(), near_ids.end()),
+                           near_ids.end());
+        }
     }
 
-    for (auto new_id : new_view_list) {
-        clients[new_id].then([&client, &old_view_list](auto &other) {
-            auto it = old_view_list.find(other.id);
-            if (it == old_view_list.end()) {
-                other.insert_to_view(client.id);
-                client.insert_to_view(other.id);
-                send_put_object_packet(client, other);
-                send_put_object_packet(other, client);
+    for (auto near_id : near_ids) {
+        with_client(near_id, [id, &old_pos, &new_pos](SOCKETINFO &cl) {
+            if (cl.is_proxy)
+                return;
+            bool saw = old_pos && is_near(cl.x, cl.y, old_pos->x, old_pos->y);
+            bool sees = new_pos && is_near(cl.x, cl.y, new_pos->x, new_pos->y);
+            if (sees && !saw) {
+                cl.insert_to_view(id);
+                send_put_object_packet(cl, id, new_pos->x, new_pos->y, true);
+            } else if (sees) {
+                send_pos_packet(cl, id, new_pos->x, new_pos->y);
+            } else if (saw) {
+                cl.erase_from_view(id);
+                send_remove_object_packet(cl, id);
             }
         });
     }
+}
 
+struct ViewDiff {
+    vector<unsigned> entered;
+    vector<unsigned> left;
+    vector<unsigned> stayed;
+};
+
+// Rebuilds the view from a scan around the client.
+void diff_view_full(SOCKETINFO &client, const vector<unsigned> &near_ids,
+                    const set<unsigned> &old_view_list, ViewDiff &diff) {
+    set<unsigned> new_view_list;
+    for (auto near_id : near_ids) {
+        if (near_id != client.id)
+            new_view_list.emplace(near_id);
+    }
+
+    for (auto new_id : new_view_list)
+        if (old_view_list.count(new_id) == 0)
+            diff.entered.emplace_back(new_id);
     for (auto old_id : old_view_list) {
-        clients[old_id].then([&client, &new_view_list](auto &other) {
-            auto it = new_view_list.find(other.id);
-            if (it == new_view_list.end()) {
-                other.erase_from_view(client.id);
-                client.erase_from_view(other.id);
-                send_remove_object_packet(client, other);
-                send_remove_object_packet(other, client);
-            } else {
-                send_pos_packet(other, client);
-            }
+        if (new_view_list.count(old_id) == 0)
+            diff.left.emplace_back(old_id);
+        else
+            diff.stayed.emplace_back(old_id);
+    }
+}
+
+// After a one tile step only the row or column entering the view square
+// can hold new entities, and only ids already in the view can leave it, so
+// the view is patched instead of rebuilt.
+void diff_view_step(SOCKETINFO &client, short old_x, short old_y,
+                    const set<unsigned> &old_view_list, ViewDiff &diff) {
+    const short dx = client.x - old_x, dy = client.y - old_y;
+    short min_x = client.x - VIEW_RANGE, max_x = client.x + VIEW_RANGE;
+    short min_y = client.y - VIEW_RANGE, max_y = client.y + VIEW_RANGE;
+    if (dx > 0)
+        min_x = max_x;
+    else if (dx < 0)
+        max_x = min_x;
+    else if (dy > 0)
+        min_y = max_y;
+    else
+        max_y = min_y;
+
+    vector<unsigned> strip;
+    entities.query_rect(min_x, max_x, min_y, max_y,
+                        ENTITY_ACTIVE | ENTITY_LOGGED_IN, live_ids.bound(),
+                        strip);
+    for (auto id : strip)
+        if (id != client.id && old_view_list.count(id) == 0)
+            diff.entered.emplace_back(id);
+
+    for (auto old_id : old_view_list) {
+        const auto index = id_index(old_id);
+        if (entities.id(index) == old_id &&
+            entities.has_flags(index, ENTITY_ACTIVE | ENTITY_LOGGED_IN) &&
+            is_near(client.x, client.y, entities.x(index), entities.y(index)))
+            diff.stayed.emplace_back(old_id);
+        else
+            diff.left.emplace_back(old_id);
+    }
+}
+
+// Tells the client and the clients that came into or went out of its view
+// about each other, and the ones that still see it where it is now.
+void apply_view_diff(SOCKETINFO &client, const ViewDiff &diff) {
+    for (auto new_id : diff.entered) {
+        if (is_ghost(new_id)) {
+            client.insert_to_view(new_id);
+            send_put_ghost_packet(client, new_id);
+            continue;
+        }
+        with_client(new_id, [&client](auto &other) {
+            other.insert_to_view(client.id);
+            client.insert_to_view(other.id);
+            send_put_object_packet(client, other);
+            send_put_object_packet(other, client);
         });
     }
 
+    for (auto old_id : diff.left) {
+        // Ghosts and ids gone from their slot, whose index may already hold
+        // someone else, only leave this view.
+        if (is_ghost(old_id) || !slot_of(old_id).holds(old_id)) {
+            client.erase_from_view(old_id);
+            send_remove_object_packet(client, old_id);
+            continue;
+        }
+        with_client(old_id, [&client](auto &other) {
+            other.erase_from_view(client.id);
+            client.erase_from_view(other.id);
+            send_remove_object_packet(client, other);
+            send_remove_object_packet(other, client);
+        });
+    }
+
+    for (auto id : diff.stayed) {
+        if (!is_ghost(id))
+            with_client(id, [&client](auto &other) {
+                send_pos_packet(other, client);
+            });
+    }
+}
+
+// The widened bands only last while the client keeps crossing.
+void Server::decay_hysteresis(SOCKETINFO &client) {
+    auto now = std::chrono::steady_clock::now();
+    if (client.hysteresis != 0 &&
+        now - client.last_crossed_at > hysteresis_window)
+        client.hysteresis = 0;
+}
+
+// `move_type` is what the move from row `from_y` to the new position does
+// with the seam, checked with the hysteresis of the client.
+bool Server::ProcessMove(SOCKETINFO &client, short new_x, short new_y,
+                         short from_y, MoveType move_type) {
+    if (!client.is_proxy && client.hysteresis != 0) {
+        auto base_type = check_move_type(from_y, new_y, server_id, 0);
+        if (base_type == HandOver && move_type != HandOver)
+            hand_overs_avoided.add();
+        else if (base_type == LeaveFromBuffer && client.is_in_edge &&
+                 move_type != LeaveFromBuffer)
+            edge_leaves_avoided.add();
+    }
+
+    const short old_x = client.x, old_y = client.y;
+    set_position(client, new_x, new_y);
+
+    send_pos_packet(client, client);
+
+    auto old_view_list = client.copy_view_list();
+    ViewDiff diff;
+    if (abs(new_x - old_x) + abs(new_y - old_y) == 1 &&
+        move_type != HandOver && ++client.view_steps < FULL_VIEW_STEPS) {
+        diff_view_step(client, old_x, old_y, old_view_list, diff);
+    } else {
+        client.view_steps = 0;
+        diff_view_full(client, find_near(client.x, client.y), old_view_list,
+                       diff);
+    }
+
+    apply_view_diff(client, diff);
+
     if (client.is_proxy)
         return false;
 
     if (client.is_in_edge == false && move_type == EnterToEdge) {
         client.is_in_edge = true;
-        send_packet_to_server<ss_packet_put>(this->other_server_send,
+        send_packet_to_server<ss_packet_put>(this->other_server_link,
                                              [&client](ss_packet_put &p) {
                                                  p.id = client.id;
                                                  p.x = client.x;
@@ -283,10 +833,10 @@ bool Server::ProcessMove(SOCKETINFO &client, short new_x, short new_y,
     } else if (client.is_in_edge == true && move_type == LeaveFromBuffer) {
         client.is_in_edge = false;
         send_packet_to_server<ss_packet_leave>(
-            other_server_send,
+            other_server_link,
             [&client](ss_packet_leave &p) { p.id = client.id; });
     } else if (client.is_in_edge) {
-        send_packet_to_server<ss_packet_move>(other_server_send,
+        send_packet_to_server<ss_packet_move>(other_server_link,
                                               [&client](ss_packet_move &p) {
                                                   p.id = client.id;
                                                   p.x = client.x;
@@ -294,42 +844,87 @@ bool Server::ProcessMove(SOCKETINFO &client, short new_x, short new_y,
                                               });
     }
 
-    if (move_type == HandOver) {
-        client.is_proxy = true;
-        client.is_in_edge = false;
-        return true;
+    return move_type == HandOver &&
+           client.status.load(memory_order_acquire) == Normal;
+}
+
+void step(short &x, short &y, unsigned char dir, short width = WORLD_WIDTH,
+          short height = WORLD_HEIGHT) {
+    switch (dir) {
+    case D_UP:
+        if (y > 0)
+            y--;
+        break;
+    case D_DOWN:
+        if (y < height - 1)
+            y++;
+        break;
+    case D_LEFT:
+        if (x > 0)
+            x--;
+        break;
+    case D_RIGHT:
+        if (x < width - 1)
+            x++;
+        break;
+    }
+}
+
+MoveRun walk_moves(short x, short y, const vector<cs_packet_move *> &moves,
+                   unsigned server_id, short extra) {
+    const short from_y = y;
+    MoveRun run{x, y, 0, y, None};
+    for (auto move : moves) {
+        run.last_from_y = run.y;
+        step(run.x, run.y, move->direction);
+        ++run.applied;
+        // A run can enter the edge on the way to the handover line, so a
+        // handing over step wins over the ends of the run.
+        if (check_move_type(run.last_from_y, run.y, server_id, extra) ==
+            HandOver) {
+            run.type = HandOver;
+            return run;
+        }
     }
+    run.type = check_move_type(from_y, run.y, server_id, extra);
+    return run;
+}
 
-    return false;
+// Walks a run of moves and updates the view once, at the end of it. Returns
+// how many moves were applied and whether to hand over.
+pair<size_t, bool>
+Server::ProcessMoves(SOCKETINFO &cl, const vector<cs_packet_move *> &moves) {
+    decay_hysteresis(cl);
+    auto run = walk_moves(cl.x, cl.y, moves, server_id, cl.hysteresis);
+    for (size_t i = 0; i < run.applied; ++i)
+        if (moves[i]->move_time != 0)
+            cl.move_time = moves[i]->move_time;
+    const short from_y = run.type == HandOver ? run.last_from_y : cl.y;
+    return {run.applied, ProcessMove(cl, run.x, run.y, from_y, run.type)};
 }
 
 bool Server::ProcessMove(int id, unsigned char dir, unsigned move_time) {
-    auto &client_slot = clients[id];
-    if (!client_slot)
+    auto &client_slot = slot_of(id);
+    if (!client_slot.holds(id))
         return false;
-    auto &client = client_slot.ptr;
+    auto client = client_slot.get();
 
     if (move_time != 0)
         client->move_time = move_time;
 
+    if (client->instance != nullptr) {
+        ProcessInstanceMove(*client, dir);
+        return false;
+    }
+
     short x = client->x;
     short y = client->y;
     switch (dir) {
     case D_UP:
-        if (y > 0)
-            y--;
-        break;
     case D_DOWN:
-        if (y < WORLD_HEIGHT - 1)
-            y++;
-        break;
     case D_LEFT:
-        if (x > 0)
-            x--;
-        break;
     case D_RIGHT:
-        if (x < WORLD_WIDTH - 1)
-            x++;
+        step(x, y, dir);
         break;
     case 99: {
         auto [new_x, new_y] = make_random_position(server_id);
@@ -337,82 +932,312 @@ bool Server::ProcessMove(int id, unsigned char dir, unsigned move_time) {
         y = new_y;
     } break;
     default:
-        cout << "Invalid Direction Error\n";
-        while (true)
-            ;
+        LOG(LogWarn, "Invalid direction ", int(dir), " from #", id);
+        return false;
+    }
+
+    decay_hysteresis(*client);
+    return ProcessMove(
+        *client, x, y, client->y,
+        check_move_type(client->y, y, server_id, client->hysteresis));
+}
+
+// An instance has no seam, so a move in it only updates the view.
+void Server::ProcessInstanceMove(SOCKETINFO &cl, unsigned char dir) {
+    auto &instance = *cl.instance;
+    short x = cl.x;
+    short y = cl.y;
+    if (dir == 99) {
+        x = fast_rand() % instance.width();
+        y = fast_rand() % instance.height();
+    } else {
+        step(x, y, dir, instance.width(), instance.height());
     }
+    set_position(cl, x, y);
 
-    return ProcessMove(*client, x, y, move_time);
+    send_pos_packet(cl, cl);
+
+    ViewDiff diff;
+    diff_view_full(cl, instance.find_near(x, y, VIEW_RANGE),
+                   cl.copy_view_list(), diff);
+    apply_view_diff(cl, diff);
 }
 
-void Server::ProcessChat(int id, char *mess) {
-    auto &client_slot = clients[id];
-    if (!client_slot)
+vector<unsigned> Server::near_of(SOCKETINFO &cl) {
+    if (cl.instance != nullptr)
+        return cl.instance->find_near(cl.x, cl.y, VIEW_RANGE);
+    return find_near(cl.x, cl.y);
+}
+
+// Everyone who sees the client forgets it, and in the world its ghost on
+// the other server goes too. The client keeps its own view, so what it
+// gets next can be a difference.
+void Server::leave_area(SOCKETINFO &cl) {
+    for (auto near_id : cl.copy_view_list()) {
+        with_client(near_id, [&cl](SOCKETINFO &other) {
+            other.erase_from_view(cl.id);
+            send_remove_object_packet(other, cl);
+        });
+    }
+
+    if (cl.instance != nullptr) {
+        cl.instance->leave(cl.instance_row);
+        cl.instance = nullptr;
         return;
-    auto &client = client_slot.ptr;
+    }
+    entities.set_flags(id_index(cl.id), 0);
+    if (cl.is_in_edge) {
+        cl.is_in_edge = false;
+        send_packet_to_server<ss_packet_leave>(
+            other_server_link, [&cl](ss_packet_leave &p) { p.id = cl.id; });
+    }
+}
 
-    for (auto i = 0; i < user_num.load(memory_order_relaxed); ++i) {
-        clients[i].then([&client, id, mess](auto &other) {
-            send_chat_packet(other, id, mess);
+// Sends the client what is around it now, given what it saw before, and
+// puts it in the view of those around it. After a handover they already
+// know it, as the ghost or proxy they had.
+void Server::enter_area(SOCKETINFO &cl, const set<unsigned> &old_view,
+                        bool is_known) {
+    set<unsigned> new_view;
+    PutObjectBatch snapshot{cl};
+    for (auto near_id : near_of(cl)) {
+        if (near_id == cl.id)
+            continue;
+        if (is_ghost(near_id)) {
+            new_view.emplace(near_id);
+            if (old_view.count(near_id) == 0)
+                send_put_ghost_packet(snapshot, near_id);
+            continue;
+        }
+        with_client(near_id, [&cl, &old_view, &new_view, &snapshot,
+                              is_known](SOCKETINFO &other) {
+            new_view.emplace(other.id);
+            other.insert_to_view(cl.id);
+            if (!is_known)
+                send_put_object_packet(other, cl);
+            if (old_view.count(other.id) == 0)
+                snapshot.add(other);
         });
     }
+    snapshot.flush();
+    for (auto old_id : old_view) {
+        if (new_view.count(old_id) == 0)
+            send_remove_object_packet(cl, old_id);
+    }
+    cl.replace_view(move(new_view));
 }
 
-void Server::ProcessLogin(int user_id, char *id_str) {
-    auto &client_slot = clients[user_id];
-    auto &client = client_slot.ptr;
+// Moves the client between the world and the instances of this server the
+// way a handover moves it between servers: it leaves the old area for
+// everyone there, then only gets the difference of what it sees.
+// True when the client is back in the world past the seam, which moved
+// while it was in the instance, so it has to be handed over.
+bool Server::EnterInstance(SOCKETINFO &cl, int instance_id) {
+    if (cl.is_proxy || cl.status.load(memory_order_acquire) != Normal)
+        return false;
+    WorldInstance *target = nullptr;
+    if (instance_id != 0) {
+        if (instance_id < 0 || instance_id > int(instances.size()))
+            return false;
+        target = instances[instance_id - 1].get();
+    }
+    if (target == cl.instance)
+        return false;
 
-    client->name = id_str;
-    send_login_ok_packet(*client, user_id);
+    short x = cl.world_x, y = cl.world_y;
+    optional<unsigned> row;
+    if (target != nullptr) {
+        x = fast_rand() % target->width();
+        y = fast_rand() % target->height();
+        row = target->join(cl.id, x, y);
+        if (!row)
+            return false;
+    }
 
-    client_slot.ptr->is_logged_in = true;
-    for (auto i = 0; i < user_num.load(memory_order_relaxed); ++i) {
-        clients[i].then([&client](auto &other) {
-            if (is_near(other.x, other.y, client->x, client->y) == false ||
-                other.is_logged_in != true) {
-                return;
-            }
+    auto old_view = cl.copy_view_list();
+    bool is_hand_over = false;
+    if (cl.instance == nullptr) {
+        cl.world_x = cl.x;
+        cl.world_y = cl.y;
+    }
+    leave_area(cl);
+
+    if (target != nullptr) {
+        cl.instance = target;
+        cl.instance_row = *row;
+        set_position(cl, x, y);
+    } else {
+        set_position(cl, x, y);
+        entities.set_flags(id_index(cl.id), ENTITY_ACTIVE | ENTITY_LOGGED_IN);
+        // The handover puts its ghost on the other server.
+        is_hand_over = !is_in_region(y, server_id);
+        if (is_hand_over)
+            cl.is_migrating = true;
+        else if (check_in_edge(y, server_id)) {
+            cl.is_in_edge = true;
+            send_packet_to_server<ss_packet_put>(other_server_link,
+                                                 [&cl](ss_packet_put &p) {
+                                                     p.id = cl.id;
+                                                     p.x = cl.x;
+                                                     p.y = cl.y;
+                                                 });
+        }
+    }
+    instance_transfers.add();
+
+    send_pos_packet(cl, cl);
+    enter_area(cl, old_view, false);
+    return is_hand_over;
+}
+
+void Server::ProcessChat(int id, const char *mess, size_t size) {
+    auto &client_slot = slot_of(id);
+    if (!client_slot.holds(id))
+        return;
+    auto client = client_slot.get();
+
+    // Only heard in the area it is said in. Who is in which area comes from
+    // the entity tables, the instance of another client is its jobs' own.
+    vector<unsigned> listeners;
+    if (client->instance != nullptr) {
+        listeners = client->instance->members();
+    } else {
+        const auto bound = live_ids.bound();
+        for (unsigned i = 0; i < bound; ++i) {
+            if (entities.has_flags(i, ENTITY_ACTIVE | ENTITY_LOGGED_IN) &&
+                !entities.has_flags(i, ENTITY_PROXY))
+                listeners.emplace_back(entities.id(i));
+        }
+    }
+    auto packet = make_chat_packet(id, mess, size);
+    send_multicast(front_end_link, packet.data(), listeners);
+}
+
+// Goes once over the link to the other server, which fans it out to its own
+// clients like this one does.
+void Server::ProcessShout(int id, const char *mess, size_t size) {
+    if (!slot_of(id).holds(id))
+        return;
+    shouts.add();
+    send_packet_to_server<ss_packet_chat>(
+        other_server_link, [id, mess, size](ss_packet_chat &p) {
+            p.id = id;
+            copy_chat(p.chat, mess, size);
+        });
+    broadcast_chat(id, mess, size);
+}
+
+// Every client this server owns hears it, wherever it is. Like ProcessChat
+// it finds them in the entity table, the fields of other clients are their
+// jobs' own.
+void Server::broadcast_chat(int teller, const char *mess, size_t size) {
+    vector<unsigned> listeners;
+    const auto bound = live_ids.bound();
+    for (unsigned i = 0; i < bound; ++i) {
+        if (entities.has_flags(i, ENTITY_ACTIVE | ENTITY_LOGGED_IN) &&
+            !entities.has_flags(i, ENTITY_PROXY))
+            listeners.emplace_back(entities.id(i));
+    }
+    auto packet = make_chat_packet(teller, mess, size);
+    send_multicast(front_end_link, packet.data(), listeners);
+}
+
+void Server::ProcessLogin(int user_id, char *id_str, unsigned char features) {
+    auto &client_slot = slot_of(user_id);
+    auto client = client_slot.get();
+    client->is_area_snapshot = features & LOGIN_AREA_SNAPSHOT;
+
+    client->name = string{id_str, strnlen(id_str, MAX_ID_LEN - 1)};
+    if (names.claim(client->name, user_id, server_id)) {
+        reject_login(client_slot);
+        return;
+    }
+    send_packet_to_server<ss_packet_name_claim>(
+        this->other_server_link, [&client](ss_packet_name_claim &p) {
+            p.id = client->id;
+            copy_name(p.name, client->name);
+        });
+
+    if (player_db) {
+        finish_login(*client, player_db->load(client->name));
+        return;
+    }
+    // Logged in once the db server answers, see message_player_loaded.
+    send_packet_to_server<ss_packet_player_load>(
+        this->other_server_link, [&client](ss_packet_player_load &p) {
+            p.id = client->id;
+            copy_name(p.name, client->name);
+        });
+}
+
+void Server::finish_login(SOCKETINFO &client,
+                          const optional<PlayerRecord> &record) {
+    if (record) {
+        client.hp = record->hp;
+        client.level = record->level;
+        client.exp = record->exp;
+        if (is_in_region(record->y, server_id)) {
+            set_position(client, record->x, record->y);
+            client.is_in_edge = check_in_edge(client.y, server_id);
+        }
+    }
+    send_login_ok_packet(client, client.id);
+
+    set_logged_in(client, true);
+    PutObjectBatch snapshot{client};
+    for (auto near_id : find_near(client.x, client.y)) {
+        if (is_ghost(near_id)) {
+            client.insert_to_view(near_id);
+            send_put_ghost_packet(snapshot, near_id);
+            continue;
+        }
+        with_client(near_id, [&client, &snapshot](auto &other) {
             if (other.is_proxy == false) {
-                send_put_object_packet(other, *client);
+                send_put_object_packet(other, client);
             }
-            if (other.id != client->id) {
-                send_put_object_packet(*client, other);
+            if (other.id != client.id) {
+                snapshot.add(other);
             }
         });
     }
+    snapshot.flush();
 
-    if (client->is_in_edge)
-        send_packet_to_server<ss_packet_put>(this->other_server_send,
+    if (client.is_in_edge)
+        send_packet_to_server<ss_packet_put>(this->other_server_link,
                                              [&client](ss_packet_put &p) {
-                                                 p.id = client->id;
-                                                 p.x = client->x;
-                                                 p.y = client->y;
+                                                 p.id = client.id;
+                                                 p.x = client.x;
+                                                 p.y = client.y;
                                              });
 }
 
-SOCKETINFO *create_new_player(tcp::socket &sock, unsigned id, short x, short y,
+SOCKETINFO *create_new_player(LinkWriter &link, unsigned id, short x, short y,
                               bool is_proxy, unsigned server_id) {
-    bool is_in_edge = false;
-    if (server_id == 0) {
-        if (y >= WORLD_HEIGHT / 2 - EDGE_RANGE) {
-            is_in_edge = true;
-        }
-    } else {
-        if (y < WORLD_HEIGHT / 2 + EDGE_RANGE) {
-            is_in_edge = true;
-        }
-    }
+    bool is_in_edge = check_in_edge(y, server_id);
 
     SOCKETINFO *new_player =
-        new SOCKETINFO{id, sock, is_proxy, x, y, is_in_edge};
+        new SOCKETINFO{id, link, is_proxy, x, y, is_in_edge};
 
     return new_player;
 }
 
-SOCKETINFO *create_new_player(tcp::socket &sock, unsigned id, bool is_proxy,
+SOCKETINFO *create_new_player(LinkWriter &link, unsigned id, bool is_proxy,
                               unsigned server_id) {
     auto [new_x, new_y] = make_random_position(server_id);
-    return create_new_player(sock, id, new_x, new_y, is_proxy, server_id);
+    return create_new_player(link, id, new_x, new_y, is_proxy, server_id);
+}
+
+// A client handed over to this server starts from its ghost, as a proxy
+// until the handover completes.
+void promote_ghost(LinkWriter &link, unsigned id, unsigned owner_id) {
+    if (!is_ghost(id))
+        return;
+    const auto index = id_index(id);
+    auto player = create_new_player(link, id, entities.x(index),
+                                    entities.y(index), true, owner_id);
+    activate_slot(slot_of(id), player);
+    set_logged_in(*player, true);
+    player->is_in_edge = true;
 }
 
 void Server::handle_recv(const boost_error &error, const size_t length) {
@@ -422,6 +1247,7 @@ void Server::handle_recv(const boost_error &error, const size_t length) {
     } else if (length == 0) {
         exit(0);
     } else {
+        ClientGuard guard;
         assemble_packet(
             this->recv_buf, this->prev_packet_len, length,
             [this](unsigned id, unsigned char *packet, auto len) {
@@ -429,22 +1255,57 @@ void Server::handle_recv(const boost_error &error, const size_t length) {
                     unsigned char *real_packet =
                         packet + sizeof(packet_header) + sizeof(unsigned) +
                         sizeof(fs_packet_forwarding);
+                    const auto level = load_level.load(memory_order_relaxed);
                     if (real_packet[1] == cs_packet_login::type_num) {
+                        // Turned away before it costs a slot or a job.
+                        if (level == LoadOverloaded) {
+                            logins_shed.add();
+                            send_packet<sf_packet_reject_login>(
+                                front_end_link, id,
+                                [](sf_packet_reject_login &packet) {
+                                    packet.reason = REJECT_BUSY;
+                                });
+                            return;
+                        }
                         handle_accept(id);
+                    } else if ((real_packet[1] == cs_packet_chat::type_num ||
+                                real_packet[1] == cs_packet_shout::type_num) &&
+                               level != LoadNormal) {
+                        chats_shed.add();
+                        return;
                     }
+                } else if (packet[1] == fs_packet_hand_overed::type_num) {
+                    promote_ghost(front_end_link, id, 1 - server_id);
+                }
+
+                auto &slot = slot_of(id);
+                if (!slot.holds(id)) {
+                    // Nobody will run disconnect for it, but a kick may have
+                    // left a ghost of it on the other server.
+                    if (packet[1] == fs_packet_logout::type_num)
+                        send_packet_to_server<ss_packet_logout>(
+                            other_server_link,
+                            [id](ss_packet_logout &p) { p.id = id; });
+                    return;
                 }
 
                 unique_ptr<unsigned char[]> buf{new unsigned char[len]};
                 memcpy(buf.get(), packet, len);
-                clients[id].then([&buf](SOCKETINFO &cl) {
+                slot.then([&buf](SOCKETINFO &cl) {
                     switch (cl.status.load(memory_order_acquire)) {
                     case Normal:
                     case HandOvering:
                         cl.pending_packets.emplace(move(buf));
                         break;
-                    case HandOvered:
-                        cl.pending_while_hand_over_packets.emplace(move(buf));
-                        break;
+                    case HandOvered: {
+                        auto &state = cl.hand_over();
+                        std::chrono::steady_clock::rep not_stalled = 0;
+                        state.stall_started_at.compare_exchange_strong(
+                            not_stalled, std::chrono::steady_clock::now()
+                                             .time_since_epoch()
+                                             .count());
+                        state.pending_packets.emplace(move(buf));
+                    } break;
                     }
                 });
             });
@@ -453,81 +1314,174 @@ void Server::handle_recv(const boost_error &error, const size_t length) {
             buffer(this->recv_buf + prev_packet_len,
                    MAX_BUFFER - prev_packet_len),
             [this](auto error, auto length) { handle_recv(error, length); });
+        wake_master();
     }
 }
 
 void async_connect_to_other_server(tcp::socket &sock, address_v4 ip,
-                                   unsigned short port) {
-    sock.async_connect(tcp::endpoint{ip, port}, [&sock, ip, port](auto &error) {
+                                   unsigned short port,
+                                   function<void()> on_connected) {
+    sock.async_connect(tcp::endpoint{ip, port}, [&sock, ip, port,
+                                                 on_connected](auto &error) {
         if (error) {
             cerr << "Can't connect to other server(cause : " << error.message()
                  << ")" << endl;
             std::this_thread::sleep_for(1s);
             cerr << "Retry..." << endl;
             sock.close();
-            async_connect_to_other_server(sock, ip, port);
+            async_connect_to_other_server(sock, ip, port, on_connected);
         } else {
             cerr << "Connected to other server" << endl;
+            on_connected();
         }
     });
 }
 
-Server::Server(unsigned id, unsigned short accept_port,
-               unsigned short other_server_accept_port)
+Server::Server(const ServerConfig &config)
     : context{}, acceptor{context}, server_acceptor{context},
-      other_server_send{context}, other_server_recv{context}, front_end_sock{
-                                                                  context} {
+      other_server_recv{context}, other_server_send{context},
+      front_end_sock{context},
+      wait_policy{config.wait_policy}, io_cpus{config.io_cpus},
+      scheduler_cpus{config.scheduler_cpus}, worker_cpus{config.worker_cpus},
+      load_interval{config.load_interval}, shed_load{config.shed_load},
+      overload_load{config.overload_load}, max_backlog{config.max_backlog},
+      player_db{config.id == DB_SERVER_ID
+                    ? make_unique<PlayerDB>(config.db_path,
+                                            config.db_commit_interval)
+                    : nullptr},
+      db_save_interval{config.db_save_interval},
+      names{config.name_directory_capacity},
+      world_snapshot{config.snapshot_path, MAX_USER_NUM},
+      snapshot_interval{config.snapshot_interval},
+      hysteresis_step{config.hysteresis_step},
+      hysteresis_max{config.hysteresis_max},
+      hysteresis_window{config.hysteresis_window},
+      metrics_interval{config.metrics_interval} {
     tcp::acceptor::reuse_address option{true};
 
-    auto end_point = tcp::endpoint{tcp::v4(), accept_port};
+    auto end_point = tcp::endpoint{tcp::v4(), config.accept_port};
     acceptor.open(end_point.protocol());
     acceptor.set_option(option);
     acceptor.bind(end_point);
     acceptor.listen();
 
-    server_id = id;
+    server_id = config.id;
 
-    auto other_end_point = tcp::endpoint{tcp::v4(), other_server_accept_port};
+    auto other_end_point =
+        tcp::endpoint{tcp::v4(), config.other_server_accept_port};
     server_acceptor.open(other_end_point.protocol());
     server_acceptor.set_option(option);
     server_acceptor.bind(other_end_point);
     server_acceptor.listen();
+
+    // Numbered from 1, 0 stands for the world.
+    for (unsigned i = 0; i < config.instance_count; ++i)
+        instances.emplace_back(make_unique<WorldInstance>(
+            i + 1, config.instance_width, config.instance_height,
+            config.instance_capacity));
+
+    restore_snapshot();
+}
+
+// The move inside a packet from the front end, if it is a plain step.
+cs_packet_move *forwarded_move(unsigned char *packet) {
+    if (packet[1] != fs_packet_forwarding::type_num)
+        return nullptr;
+    unsigned char *inner = packet + sizeof(packet_header) + sizeof(unsigned) +
+                           sizeof(fs_packet_forwarding);
+    if (inner[1] != cs_packet_move::type_num)
+        return nullptr;
+    auto move = (cs_packet_move *)(inner + sizeof(packet_header));
+    if ((unsigned char)move->direction > D_RIGHT)
+        return nullptr;
+    return move;
+}
+
+// Input parked while a handover is in flight only counts once it is over.
+bool has_pending(SOCKETINFO &cl) {
+    return !cl.pending_packets.is_empty() ||
+           (cl.status.load(memory_order_acquire) == Normal &&
+            cl.has_hand_over_packets());
 }
 
 void Server::do_worker(unsigned worker_id) {
+    if (!pin_this_thread(cpus_of(worker_cpus, worker_id)))
+        cerr << "Can't pin worker " << worker_id << endl;
+    // Touched first from here, so it lives on the node of the worker.
+    pending_pos_recipients.reserve(1024);
+
     SPSCQueue<unsigned> &queue = this->worker_queue[worker_id];
     while (true) {
         if (queue.is_empty()) {
-            this_thread::yield();
+            auto wake_latency =
+                wait_until(worker_parkers[worker_id], wait_policy,
+                           [&queue]() { return !queue.is_empty(); });
+            if (wake_latency)
+                worker_wake_latency.record(*wake_latency);
             continue;
         }
 
         auto user_id = *queue.deq();
-
-        clients[user_id].then([this, user_id](SOCKETINFO &cl) {
-            if (cl.status.load(memory_order_acquire) == Normal) {
-                cl.pending_while_hand_over_packets.for_each(
+        auto started_at = std::chrono::steady_clock::now();
+        ClientGuard guard;
+
+        auto &slot = slot_of(user_id);
+        with_client(user_id, [this, user_id](SOCKETINFO &cl) {
+            if (cl.status.load(memory_order_acquire) == Normal &&
+                cl.has_hand_over_packets()) {
+                cl.hand_over().pending_packets.for_each(
                     [this, user_id](unique_ptr<unsigned char[]> packet) {
                         this->process_packet_from_front_end(user_id,
                                                             move(packet));
                     });
             }
-            bool is_hand_overed = false;
             auto pending_len = cl.pending_packets.size();
-            for (auto i = 0; i < pending_len; ++i) {
-                auto packet = *cl.pending_packets.deq();
-                is_hand_overed =
-                    this->process_packet_from_front_end(user_id, move(packet));
-                if (is_hand_overed) {
-                    cl.status.store(HandOvering, memory_order_release);
-                    send_packet<sf_packet_hand_over>(
-                        cl, [](sf_packet_hand_over &packet) {});
-                    is_hand_overed = false;
+            vector<unique_ptr<unsigned char[]>> packets;
+            packets.reserve(pending_len);
+            for (size_t i = 0; i < pending_len; ++i)
+                packets.emplace_back(*cl.pending_packets.deq());
+
+            // Consecutive moves share one view update. Anything else, a
+            // chat for one, splits the run so the order holds.
+            vector<cs_packet_move *> moves;
+            for (size_t i = 0; i < packets.size();) {
+                moves.clear();
+                for (auto j = i; j < packets.size(); ++j) {
+                    auto move = forwarded_move(packets[j].get());
+                    if (move == nullptr)
+                        break;
+                    moves.emplace_back(move);
+                }
+                if (moves.size() > 1 && cl.instance == nullptr &&
+                    cl.status.load(memory_order_acquire) == Normal) {
+                    auto [applied, is_hand_over] = ProcessMoves(cl, moves);
+                    i += applied;
+                    if (is_hand_over)
+                        begin_hand_over(cl);
+                    continue;
                 }
+
+                if (this->process_packet_from_front_end(user_id,
+                                                        move(packets[i])))
+                    begin_hand_over(cl);
+                ++i;
             }
         });
 
-        clients[user_id].ptr->is_handling.store(false, memory_order_release);
+        flush_pending_positions();
+        worker_busy_ns[worker_id].fetch_add(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - started_at)
+                .count(),
+            memory_order_relaxed);
+
+        if (auto player = slot.get(); player && player->id == user_id) {
+            auto &cl = *player;
+            cl.is_handling.store(false, memory_order_release);
+            // The master may have skipped it while it was being handled.
+            if (has_pending(cl))
+                wake_master();
+        }
     }
 }
 
@@ -545,29 +1499,133 @@ void Server::run(const string &other_server_ip,
         }
     });
 
-    thread io_thread{[this]() { context.run(); }};
+    thread io_thread{[this]() {
+        if (!pin_this_thread(io_cpus))
+            cerr << "Can't pin the io thread" << endl;
+        context.run();
+    }};
     thread master_thread{[this]() {
+        if (!pin_this_thread(scheduler_cpus))
+            cerr << "Can't pin the master thread" << endl;
         unsigned next_worker_id = 0;
+        auto last_save_time = std::chrono::steady_clock::now();
+        auto last_metrics_time = last_save_time;
+        auto last_snapshot_time = last_save_time;
+        last_load_time = last_save_time;
         while (true) {
-            for (unsigned i = 0; i < user_num.load(memory_order_acquire); ++i) {
-                clients[i].then([this, &next_worker_id, i](SOCKETINFO &cl) {
-                    if (cl.is_handling.load(memory_order_acquire) == true)
-                        return;
-
-                    if (cl.pending_packets.is_empty() &&
-                        cl.pending_while_hand_over_packets.is_empty())
-                        return;
-
-                    if (cl.is_handling.exchange(true) == true)
-                        return;
-                    this->worker_queue[next_worker_id].emplace(i);
-                    next_worker_id = (next_worker_id + 1) % NUM_WORKER;
-                });
+            auto now = std::chrono::steady_clock::now();
+            if (load_interval.count() > 0 &&
+                now - last_load_time >= load_interval)
+                update_load();
+            if (metrics_interval.count() > 0 &&
+                now - last_metrics_time >= metrics_interval) {
+                last_metrics_time = now;
+                hand_over_latency.print(cerr);
+                cerr << endl;
+                hand_over_stall.print(cerr);
+                cerr << endl;
+                worker_wake_latency.print(cerr);
+                cerr << endl;
+                snapshot_build.print(cerr);
+                cerr << endl;
+                hand_overs.print(cerr);
+                cerr << " ";
+                hand_overs_avoided.print(cerr);
+                cerr << " ";
+                edge_leaves_avoided.print(cerr);
+                cerr << " ";
+                logins_shed.print(cerr);
+                cerr << " ";
+                chats_shed.print(cerr);
+                cerr << " ";
+                shouts.print(cerr);
+                cerr << endl;
+                cerr << "load=" << load << " load_level=" << load_level.load()
+                     << endl;
+                if (region_migrated.value() != 0) {
+                    cerr << "seam_y=" << seam_y.load() << " ";
+                    region_migrated.print(cerr);
+                    cerr << " ";
+                    region_migration.print(cerr);
+                    cerr << endl;
+                }
+                if (!instances.empty()) {
+                    unsigned in_instances = 0;
+                    for (auto &instance : instances)
+                        in_instances += instance->population();
+                    cerr << "instances=" << instances.size()
+                         << " instance_clients=" << in_instances << " ";
+                    instance_transfers.print(cerr);
+                    cerr << endl;
+                }
+                cerr << "live_clients=" << live_ids.live()
+                     << " client_slot_segments=" << clients.allocated_segments()
+                     << endl;
+            }
+            if (now - last_save_time >= db_save_interval) {
+                last_save_time = now;
+                ClientGuard guard;
+                for (unsigned i = 0; i < live_ids.bound(); ++i) {
+                    clients[i].then([](SOCKETINFO &cl) {
+                        cl.pending_packets.emplace(
+                            make_message<message_save>(cl.id, [](auto &) {}));
+                    });
+                }
             }
+            if (snapshot_interval.count() > 0 &&
+                now - last_snapshot_time >= snapshot_interval) {
+                last_snapshot_time = now;
+                take_snapshot();
+            }
+
+            auto schedule_pending = [this, &next_worker_id]() {
+                has_pending_work.exchange(false);
+                ClientGuard guard;
+                bool has_scheduled = false;
+                for (unsigned i = 0; i < live_ids.bound(); ++i) {
+                    clients[i].then([this, &next_worker_id,
+                                     &has_scheduled](SOCKETINFO &cl) {
+                        if (cl.is_handling.load(memory_order_acquire) == true)
+                            return;
+
+                        if (!has_pending(cl))
+                            return;
+
+                        if (cl.is_handling.exchange(true) == true)
+                            return;
+                        this->worker_queue[next_worker_id].emplace(cl.id);
+                        this->worker_parkers[next_worker_id].notify();
+                        next_worker_id = (next_worker_id + 1) % NUM_WORKER;
+                        has_scheduled = true;
+                    });
+                }
+                return has_scheduled;
+            };
+            if (schedule_pending())
+                continue;
+
+            auto next_task_time = last_save_time + db_save_interval;
+            if (metrics_interval.count() > 0)
+                next_task_time =
+                    min(next_task_time, last_metrics_time + metrics_interval);
+            if (snapshot_interval.count() > 0)
+                next_task_time = min(next_task_time,
+                                     last_snapshot_time + snapshot_interval);
+            if (load_interval.count() > 0)
+                next_task_time =
+                    min(next_task_time, last_load_time + load_interval);
+            wait_until(
+                master_parker, wait_policy,
+                [this]() {
+                    return has_pending_work.load(memory_order_acquire);
+                },
+                max(next_task_time - now,
+                    std::chrono::steady_clock::duration::zero()));
         }
     }};
     for (int i = 0; i < NUM_WORKER; ++i)
         worker_threads.emplace_back([this, i]() { do_worker(i); });
+    thread console_thread{[this]() { run_console(); }};
     cerr << "Server has started" << endl;
 
     server_acceptor.async_accept(other_server_recv, [this](boost_error error) {
@@ -586,57 +1644,361 @@ void Server::run(const string &other_server_ip,
     });
 
     auto ip = make_address_v4(other_server_ip);
-    async_connect_to_other_server(other_server_send, ip, other_server_port);
+    async_connect_to_other_server(
+        other_server_send, ip, other_server_port, [this]() {
+            for (auto &record : restored_records)
+                store_player(record, true);
+            restored_records.clear();
+        });
 
     io_thread.join();
     for (auto &th : worker_threads)
         th.join();
+    console_thread.join();
+}
+
+// Reads operator commands from the standard input, one per line.
+//   seam <y>  moves the seam to row y on both servers
+// Give a command to one server only, the other one follows it.
+void Server::run_console() {
+    const int margin = EDGE_RANGE + BUFFER_RANGE + hysteresis_max;
+    string line;
+    while (getline(cin, line)) {
+        istringstream words{line};
+        string command;
+        words >> command;
+        if (command == "seam") {
+            int y;
+            if (!(words >> y) || y <= margin || WORLD_HEIGHT - margin <= y) {
+                cerr << "Usage : seam <y>, " << margin << " < y < "
+                     << WORLD_HEIGHT - margin << endl;
+                continue;
+            }
+            // Staged before any handover it starts, so the other server
+            // takes those clients under the new seam.
+            const auto version = next_seam_version();
+            send_packet_to_server<ss_packet_move_seam>(
+                other_server_link, [y, version](ss_packet_move_seam &p) {
+                    p.seam_y = y;
+                    p.version = version;
+                });
+            if (move_seam(y, version))
+                cerr << "Seam moved to " << y << endl;
+            else
+                cerr << "Seam move to " << y
+                     << " lost to one from the other server" << endl;
+        } else if (!command.empty()) {
+            cerr << "Unknown command : " << command << endl;
+        }
+    }
+}
+
+// Every owned client checks where it stands on its next job, after the input
+// queued before it. Those now past the seam are handed over like any client
+// crossing it, so they stay connected and the rest of their input follows
+// them, while the front end switches each of them at its fence.
+// Returns false, and leaves the seam alone, for a move older than the last.
+bool Server::move_seam(short y, unsigned version) {
+    {
+        lock_guard<mutex> lg{seam_lock};
+        if (version <= seam_version)
+            return false;
+        seam_version = version;
+        seam_moved_at.store(
+            std::chrono::steady_clock::now().time_since_epoch().count());
+        seam_y.store(y);
+    }
+    ClientGuard guard;
+    for (unsigned i = 0; i < live_ids.bound(); ++i) {
+        clients[i].then([](SOCKETINFO &cl) {
+            if (cl.is_logged_in && !cl.is_proxy)
+                cl.pending_packets.emplace(
+                    make_message<message_seam_moved>(cl.id, [](auto &) {}));
+        });
+    }
+    wake_master();
+    return true;
+}
+
+unsigned Server::next_seam_version() {
+    lock_guard<mutex> lg{seam_lock};
+    return ((seam_version >> 1) + 1) << 1 | server_id;
+}
+
+void Server::wake_master() {
+    has_pending_work.store(true, memory_order_release);
+    master_parker.notify();
+}
+
+// Runs on the master thread. The load is the larger of how busy the workers
+// were since the last call and how much input waits for them, smoothed so a
+// single burst does not flip the level. A level is only left once the load
+// is well below where it was entered.
+void Server::update_load() {
+    auto now = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       now - last_load_time)
+                       .count();
+    last_load_time = now;
+
+    uint64_t busy_ns = 0;
+    for (auto &busy : worker_busy_ns)
+        busy_ns += busy.load(memory_order_relaxed);
+    double busy_ratio =
+        elapsed > 0 ? double(busy_ns - last_busy_ns) / (elapsed * NUM_WORKER)
+                    : 0;
+    last_busy_ns = busy_ns;
+
+    size_t backlog = 0;
+    ClientGuard guard;
+    for (unsigned i = 0; i < live_ids.bound(); ++i)
+        clients[i].then([&backlog](SOCKETINFO &cl) {
+            backlog += cl.pending_packets.size();
+        });
+
+    double sample = max(busy_ratio, double(backlog) / max<size_t>(max_backlog, 1));
+    load = (load + sample) / 2;
+
+    constexpr double exit_margin = 0.1;
+    auto level = load_level.load(memory_order_relaxed);
+    if (load >= overload_load)
+        level = LoadOverloaded;
+    else if (level == LoadOverloaded && load < overload_load - exit_margin)
+        level = load >= shed_load ? LoadShedding : LoadNormal;
+
+    if (level == LoadNormal && load >= shed_load)
+        level = LoadShedding;
+    else if (level == LoadShedding && load < shed_load - exit_margin)
+        level = LoadNormal;
+    load_level.store(level, memory_order_relaxed);
 }
 
 SOCKETINFO &Server::handle_accept(unsigned user_id) {
     auto new_player =
-        create_new_player(this->front_end_sock, user_id, false, server_id);
-    auto &slot = clients[new_player->id];
-    slot.ptr.reset(new_player);
-    slot.is_active.store(true, memory_order_release);
-    auto old_user_num = user_num.load(memory_order_relaxed);
-    if (old_user_num <= user_id)
-        user_num.fetch_add(user_id - old_user_num + 1, memory_order_relaxed);
+        create_new_player(this->front_end_link, user_id, false, server_id);
+    activate_slot(slot_of(new_player->id), new_player);
 
     return *new_player;
 }
 
+void Server::save_player(SOCKETINFO &cl) {
+    // Until its record is loaded the db holds a newer state than the client.
+    if (cl.name.empty() || !cl.is_logged_in)
+        return;
+
+    PlayerRecord record{};
+    copy_name(record.name, cl.name);
+    const bool is_in_instance = cl.instance != nullptr;
+    record.x = is_in_instance ? cl.world_x : cl.x;
+    record.y = is_in_instance ? cl.world_y : cl.y;
+    record.hp = cl.hp;
+    record.level = cl.level;
+    record.exp = cl.exp;
+    record.saved_at = record_time();
+    store_player(record, false);
+}
+
+void Server::store_player(const PlayerRecord &record, bool is_restored) {
+    if (player_db) {
+        if (is_restored)
+            player_db->restore(record);
+        else
+            player_db->save(record);
+        return;
+    }
+    send_packet_to_server<ss_packet_player_save>(
+        other_server_link, [&record, is_restored](ss_packet_player_save &p) {
+            memcpy(p.name, record.name, MAX_ID_LEN);
+            p.x = record.x;
+            p.y = record.y;
+            p.hp = record.hp;
+            p.level = record.level;
+            p.exp = record.exp;
+            p.saved_at = record.saved_at;
+            p.is_restored = is_restored;
+        });
+}
+
+// Asks every client for its row of a new round, the rows come in from
+// their jobs and the writer thread of the snapshot publishes the round when
+// the next one is opened.
+void Server::take_snapshot() {
+    auto started_at = std::chrono::steady_clock::now();
+    const auto round = world_snapshot.next_round();
+    ClientGuard guard;
+    for (unsigned i = 0; i < live_ids.bound(); ++i) {
+        clients[i].then([round](SOCKETINFO &cl) {
+            cl.pending_packets.emplace(make_message<message_snapshot>(
+                cl.id, [round](message_snapshot &p) { p.round = round; }));
+        });
+    }
+    snapshot_build.record(std::chrono::steady_clock::now() - started_at);
+}
+
+// Sessions do not survive a restart, the front end drops with the link. What
+// the snapshot brings back is the state of every player this server owned,
+// unless the db has a later save of the player, from a logout or a handover
+// to the other server. Without the db here the rows wait for the link to the
+// server with it.
+void Server::restore_snapshot() {
+    auto started_at = std::chrono::steady_clock::now();
+    unsigned restored = 0;
+    for (auto &entity : world_snapshot.load()) {
+        if (entity.name[0] == '\0')
+            continue;
+        PlayerRecord record;
+        memcpy(record.name, entity.name, MAX_ID_LEN);
+        record.x = entity.x;
+        record.y = entity.y;
+        record.hp = entity.hp;
+        record.level = entity.level;
+        record.exp = entity.exp;
+        record.saved_at = entity.saved_at;
+        if (player_db)
+            player_db->restore(record);
+        else
+            restored_records.emplace_back(record);
+        ++restored;
+    }
+    if (restored > 0)
+        cerr << "Restored " << restored << " players from the snapshot in "
+             << std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - started_at)
+                    .count()
+             << "us" << endl;
+}
+
+// Hands the client's state to the other server right away, so it can take
+// over while the front end is still being switched.
+void Server::begin_hand_over(SOCKETINFO &cl) {
+    set_proxy(cl, true);
+    cl.is_in_edge = false;
+    save_player(cl);
+    cl.status.store(HandOvering, memory_order_release);
+    hand_overs.add();
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - cl.last_crossed_at <= hysteresis_window)
+        cl.hysteresis = min<short>(cl.hysteresis + hysteresis_step,
+                                   hysteresis_max);
+
+    // Puts and moves of the client may still be staged in the bulk lane, and
+    // the other server needs its ghost before the view and state. Whatever
+    // of them arrives after the state is dropped, see message_proxy_move.
+    send_packet_to_server<ss_packet_put>(
+        other_server_link,
+        [&cl](ss_packet_put &p) {
+            p.id = cl.id;
+            p.x = cl.x;
+            p.y = cl.y;
+        },
+        LinkWriter::Control);
+
+    constexpr unsigned view_header_size =
+        sizeof(packet_header) + sizeof(ss_packet_hand_over_view);
+    constexpr unsigned max_ids_per_packet =
+        (UCHAR_MAX - view_header_size) / sizeof(unsigned);
+    auto view = cl.copy_view_list();
+    for (auto it = view.begin(); it != view.end();) {
+        unsigned count =
+            min<size_t>(distance(it, view.end()), max_ids_per_packet);
+        unsigned total_size = view_header_size + count * sizeof(unsigned);
+        send_packet_to_server(
+            other_server_link, total_size,
+            [&cl, &it, count, total_size](unsigned char *p) {
+                packet_header *header = (packet_header *)p;
+                header->size = total_size;
+                header->type = ss_packet_hand_over_view::type_num;
+                ((ss_packet_hand_over_view *)(header + 1))->id = cl.id;
+                unsigned *ids = (unsigned *)(p + view_header_size);
+                for (unsigned i = 0; i < count; ++i, ++it)
+                    ids[i] = *it;
+            },
+            LinkWriter::Control);
+    }
+    send_packet_to_server<ss_packet_hand_over_state>(
+        other_server_link, [&cl](ss_packet_hand_over_state &packet) {
+            packet.id = cl.id;
+            packet.x = cl.x;
+            packet.y = cl.y;
+            copy_name(packet.name, cl.name);
+            packet.hp = cl.hp;
+            packet.level = cl.level;
+            packet.exp = cl.exp;
+            packet.hysteresis = cl.hysteresis;
+            auto stream = cl.position_stream.load();
+            packet.is_compact_pos = stream != nullptr;
+            packet.pos_epoch = stream ? stream->current_epoch() : 0;
+            packet.is_area_snapshot = cl.is_area_snapshot;
+        });
+    send_packet<sf_packet_hand_over>(cl, [](sf_packet_hand_over &) {});
+}
+
+void Server::reject_login(ClientSlot &slot) {
+    auto client = slot.get();
+    send_packet<sf_packet_reject_login>(
+        *client, [](sf_packet_reject_login &packet) {
+            packet.reason = REJECT_NAME_TAKEN;
+        });
+    client->name.clear();
+    deactivate_slot(slot);
+}
+
 void Server::disconnect(unsigned id) {
-    auto &client_slot = clients[id];
-    if (!client_slot)
+    auto &client_slot = slot_of(id);
+    if (!client_slot.holds(id))
         return;
-    client_slot.ptr->is_logged_in = false;
-    client_slot.is_active.store(false);
-    auto &client = client_slot.ptr;
-
-    for (auto i = 0; i < user_num.load(memory_order_relaxed); ++i) {
-        clients[i].then([&client](auto &other) {
-            if (is_near(other.x, other.y, client->x, client->y) &&
-                other.is_logged_in)
+    // Leaving the instance takes it out of every view it was in.
+    const bool is_in_world = client_slot.get()->instance == nullptr;
+    if (auto &cl = *client_slot.get(); !is_in_world) {
+        leave_area(cl);
+        set_position(cl, cl.world_x, cl.world_y);
+    }
+    save_player(*client_slot.get());
+    if (names.release(client_slot.get()->name, id)) {
+        send_packet_to_server<ss_packet_name_release>(
+            other_server_link, [&client_slot, id](ss_packet_name_release &p) {
+                p.id = id;
+                copy_name(p.name, client_slot.get()->name);
+            });
+    }
+    deactivate_slot(client_slot);
+    auto client = client_slot.get();
+
+    // Whoever sees it, found by the scan or known from its own view.
+    if (is_in_world) {
+        auto near_ids = find_near(client->x, client->y);
+        for (auto view_id : client->copy_view_list())
+            near_ids.emplace_back(view_id);
+        sort(near_ids.begin(), near_ids.end());
+        near_ids.erase(unique(near_ids.begin(), near_ids.end()),
+                       near_ids.end());
+        for (auto near_id : near_ids) {
+            with_client(near_id, [&client](auto &other) {
+                other.erase_from_view(client->id);
                 send_remove_object_packet(other, *client);
-        });
+            });
+        }
     }
 
     if (client->is_in_edge)
         send_packet_to_server<ss_packet_leave>(
-            other_server_send,
+            other_server_link,
             [&client](ss_packet_leave &p) { p.id = client->id; });
 }
 
 void Server::handle_recv_from_server(const boost_error &error,
                                      const size_t length) {
     if (error) {
-        cerr << "Error at recv from other server: " << error.message() << endl;
+        LOG(LogError, "Error at recv from other server : ", error.message());
     } else if (length > 0) {
+        ClientGuard guard;
         assemble_packet(other_recv_buf, other_prev_len, length,
                         [this](auto _, unsigned char *packet, unsigned len) {
                             process_packet_from_server(packet, len);
                         });
+        flush_pending_positions();
+        wake_master();
 
         other_server_recv.async_read_some(
             buffer(other_recv_buf + other_prev_len,
@@ -651,36 +2013,32 @@ bool Server::process_packet_from_front_end(
     unsigned id, unique_ptr<unsigned char[]> &&packet) {
     switch (packet[1]) {
     case fs_packet_logout::type_num: {
-        clients[id].then([this, &packet](SOCKETINFO &cl) {
+        with_client(id, [this, &packet](SOCKETINFO &cl) {
             if (cl.status.load(memory_order_acquire) != Normal) {
-                cl.pending_while_hand_over_packets.emplace(move(packet));
+                cl.hand_over().pending_packets.emplace(move(packet));
             } else {
                 disconnect(cl.id);
+                send_packet_to_server<ss_packet_logout>(
+                    other_server_link,
+                    [&cl](ss_packet_logout &p) { p.id = cl.id; });
             }
         });
     } break;
     case fs_packet_hand_overed::type_num: {
-        clients[id].then([this, id](SOCKETINFO &cl) {
-            auto status = cl.status.load(memory_order_acquire);
-            if (status == Normal) {
-                cl.is_proxy = false;
-                cl.is_in_edge = false;
+        // The state from the old owner may have arrived first.
+        with_client(id, [](SOCKETINFO &cl) {
+            if (cl.is_proxy &&
+                cl.status.load(memory_order_acquire) == Normal) {
+                cl.hand_over().started_at = std::chrono::steady_clock::now();
                 cl.status.store(HandOvered);
-                send_packet_to_server<ss_packet_hand_over_started>(
-                    this->other_server_send,
-                    [id](ss_packet_hand_over_started &packet) {
-                        packet.id = id;
-                    });
-            } else {
-                cerr << "Something goes wrong during handover" << endl;
             }
         });
     } break;
     case fs_packet_forwarding::type_num: {
         bool result = false;
-        clients[id].then([&result, this, id, &packet](SOCKETINFO &cl) {
+        with_client(id, [&result, this, id, &packet](SOCKETINFO &cl) {
             if (cl.status.load(memory_order_acquire) != Normal) {
-                cl.pending_while_hand_over_packets.emplace(move(packet));
+                cl.hand_over().pending_packets.emplace(move(packet));
             } else
                 result =
                     process_packet(id, (packet.get() + sizeof(packet_header) +
@@ -689,46 +2047,183 @@ bool Server::process_packet_from_front_end(
         });
         return result;
     } break;
-    case message_hand_over_started::type_num: {
-        clients[id].then([this, id](SOCKETINFO &cl) {
+    case fs_packet_hand_over_fence::type_num: {
+        // Nothing for this client reaches this server after the fence.
+        with_client(id, [this, id](SOCKETINFO &cl) {
             auto status = cl.status.load(memory_order_acquire);
             if (status == HandOvering) {
-                cl.end_hand_over(this->other_server_send);
+                cl.end_hand_over(this->other_server_link);
+                names.set_owner(cl.name, id, 1 - server_id);
+                if (cl.is_migrating) {
+                    cl.is_migrating = false;
+                    region_migration.record(
+                        std::chrono::steady_clock::now() -
+                        std::chrono::steady_clock::time_point{
+                            std::chrono::steady_clock::duration{
+                                seam_moved_at.load()}});
+                    region_migrated.add();
+                }
             } else {
-                cerr << "Something goes wrong during handover" << endl;
+                LOG(LogWarn, "Something goes wrong during handover of #", id);
             }
         });
     } break;
-    case message_hand_over_ended::type_num: {
-        clients[id].then([this, id](SOCKETINFO &cl) {
+    case message_hand_over_state::type_num: {
+        message_hand_over_state *state_packet =
+            (message_hand_over_state *)(packet.get() + sizeof(packet_header) +
+                                        sizeof(unsigned));
+        with_client(id, [this, id, state_packet](SOCKETINFO &cl) {
             auto status = cl.status.load(memory_order_acquire);
-            if (status == HandOvered) {
-                for (auto i = 0; i < user_num.load(memory_order_acquire); ++i) {
-                    if (i == id)
-                        continue;
-                    clients[i].then([&cl](SOCKETINFO &other) {
-                        if (is_near(cl.x, cl.y, other.x, other.y)) {
-                            send_put_object_packet(cl, other);
-                        }
-                    });
+            if (status == Normal && cl.is_proxy) {
+                cl.hand_over().started_at = std::chrono::steady_clock::now();
+                cl.status.store(HandOvered);
+            } else if (status != HandOvered) {
+                LOG(LogWarn, "Something goes wrong during handover of #", id);
+                return;
+            }
+
+            // Bindings of this server from an earlier stay are stale, the
+            // client has since been given others by the previous owner.
+            if (state_packet->is_compact_pos) {
+                enable_compact_pos(cl);
+                cl.position_stream.load()->restart(state_packet->pos_epoch);
+            }
+            set_proxy(cl, false);
+            cl.is_in_edge = false;
+            set_position(cl, state_packet->x, state_packet->y);
+            cl.name = string{state_packet->name,
+                             strnlen(state_packet->name, MAX_ID_LEN)};
+            cl.hp = state_packet->hp;
+            cl.level = state_packet->level;
+            cl.exp = state_packet->exp;
+            cl.hysteresis = state_packet->hysteresis;
+            cl.is_area_snapshot = state_packet->is_area_snapshot;
+            cl.last_crossed_at = std::chrono::steady_clock::now();
+            if (auto holder = names.claim(cl.name, id, server_id)) {
+                LOG(LogWarn, "Name of #", id, " is held by #", holder->id);
+            }
+
+            // The client already has everything it saw on the old owner, so
+            // only the difference goes out.
+            auto &old_view = cl.hand_over().view;
+            enter_area(cl, old_view, true);
+            old_view.clear();
+        });
+    } break;
+    case message_hand_over_view::type_num: {
+        with_client(id, [&packet](SOCKETINFO &cl) {
+            const unsigned total_size = packet[0];
+            for (unsigned offset = sizeof(packet_header) + sizeof(unsigned);
+                 offset < total_size; offset += sizeof(unsigned))
+                cl.hand_over().view.emplace(
+                    *(unsigned *)(packet.get() + offset));
+        });
+    } break;
+    case message_forwarded::type_num: {
+        // Inputs the old owner got before the fence come ahead of anything
+        // the front end sent here since, so run them right away.
+        with_client(id, [this, id, &packet](SOCKETINFO &cl) {
+            const unsigned total_size = packet[0];
+            for (unsigned offset = sizeof(packet_header) + sizeof(unsigned);
+                 offset < total_size;
+                 offset += packet[offset]) {
+                unsigned char *inner = packet.get() + offset;
+                if (inner[1] == fs_packet_forwarding::type_num) {
+                    // Never asks for a handover while this one is open, a
+                    // move back over the seam is caught when it ends.
+                    process_packet(id, inner + sizeof(packet_header) +
+                                           sizeof(unsigned) +
+                                           sizeof(fs_packet_forwarding));
+                } else {
+                    unique_ptr<unsigned char[]> buf{
+                        new unsigned char[inner[0]]};
+                    memcpy(buf.get(), inner, inner[0]);
+                    cl.hand_over().pending_packets.emplace(move(buf));
                 }
-                cl.status.store(Normal);
-            } else {
-                cerr << "Something goes wrong during handover" << endl;
             }
         });
     } break;
+    case message_hand_over_ended::type_num: {
+        bool result = false;
+        with_client(id, [this, id, &result](SOCKETINFO &cl) {
+            if (cl.status.load(memory_order_acquire) != HandOvered) {
+                LOG(LogWarn, "Something goes wrong during handover of #", id);
+                return;
+            }
+            // A replayed move may have brought it back into the edge, then
+            // the old owner keeps it as a proxy.
+            if (!cl.is_in_edge)
+                send_packet_to_server<ss_packet_leave>(
+                    this->other_server_link,
+                    [id](ss_packet_leave &packet) { packet.id = id; });
+
+            auto now = std::chrono::steady_clock::now();
+            auto &state = cl.hand_over();
+            hand_over_latency.record(now - state.started_at);
+            auto stalled = state.stall_started_at.exchange(0);
+            if (stalled != 0)
+                hand_over_stall.record(
+                    now - std::chrono::steady_clock::time_point{
+                              std::chrono::steady_clock::duration{stalled}});
+            cl.status.store(Normal);
+
+            // Replayed input or a moved seam took it past the seam while it
+            // was on its way here.
+            if (!is_in_region(cl.y, server_id)) {
+                cl.is_migrating = seam_moved_at.load() >
+                                  state.started_at.time_since_epoch().count();
+                result = true;
+            }
+        });
+        return result;
+    } break;
+    case message_seam_moved::type_num: {
+        bool result = false;
+        with_client(id, [this, &result](SOCKETINFO &cl) {
+            // One on its way in is checked once it lands, see above.
+            if (cl.is_proxy || cl.instance != nullptr ||
+                cl.status.load(memory_order_acquire) != Normal)
+                return;
+            if (!is_in_region(cl.y, server_id)) {
+                cl.is_migrating = true;
+                result = true;
+                return;
+            }
+
+            bool is_in_edge = check_in_edge(cl.y, server_id);
+            if (is_in_edge && !cl.is_in_edge) {
+                send_packet_to_server<ss_packet_put>(
+                    other_server_link, [&cl](ss_packet_put &p) {
+                        p.id = cl.id;
+                        p.x = cl.x;
+                        p.y = cl.y;
+                    });
+            } else if (!is_in_edge && cl.is_in_edge) {
+                send_packet_to_server<ss_packet_leave>(
+                    other_server_link,
+                    [&cl](ss_packet_leave &p) { p.id = cl.id; });
+            }
+            cl.is_in_edge = is_in_edge;
+        });
+        return result;
+    } break;
     case message_proxy_in::type_num: {
-        clients[id].then([this, id](SOCKETINFO &new_client) {
-            new_client.is_logged_in = true;
+        message_proxy_in *in_packet =
+            (message_proxy_in *)(packet.get() + sizeof(packet_header) +
+                                 sizeof(unsigned));
+        with_client(id, [this, id, in_packet](SOCKETINFO &new_client) {
+            if (!new_client.is_proxy)
+                return;
+            set_position(new_client, in_packet->x, in_packet->y);
+            set_logged_in(new_client, true);
             new_client.is_in_edge = true;
-            for (auto i = 0; i < user_num.load(memory_order_relaxed); ++i) {
-                auto &slot = clients[i];
-                slot.then([&new_client](auto &cl) {
-                    if (is_near(cl.x, cl.y, new_client.x, new_client.y) &&
-                        cl.is_logged_in) {
-                        send_put_object_packet(cl, new_client);
-                    }
+            for (auto near_id : find_near(new_client.x, new_client.y)) {
+                if (near_id == id)
+                    continue;
+                with_client(near_id, [&new_client](auto &cl) {
+                    cl.insert_to_view(new_client.id);
+                    new_client.insert_to_view(cl.id);
+                    send_put_object_packet(cl, new_client);
                 });
             }
         });
@@ -737,28 +2232,97 @@ bool Server::process_packet_from_front_end(
         message_proxy_move *move_packet =
             (message_proxy_move *)(packet.get() + sizeof(packet_header) +
                                    sizeof(unsigned));
-        clients[id].then([this, move_packet](SOCKETINFO &cl) {
-            ProcessMove(cl, move_packet->x, move_packet->y, 0);
+        // Staged before a handover of the client to this server but
+        // overtaken by it, the client is ahead of this already.
+        with_client(id, [this, move_packet](SOCKETINFO &cl) {
+            if (cl.is_proxy)
+                ProcessMove(cl, move_packet->x, move_packet->y, cl.y,
+                            check_move_type(cl.y, move_packet->y, server_id,
+                                            cl.hysteresis));
         });
     } break;
     case message_proxy_leave::type_num: {
-        auto &client_slot = clients[id];
-        client_slot.then([this, &client_slot](SOCKETINFO &old_client) {
-            old_client.is_logged_in = false;
+        auto &client_slot = slot_of(id);
+        with_client(id, [this, &client_slot](SOCKETINFO &old_client) {
+            if (!old_client.is_proxy)
+                return;
             old_client.is_in_edge = false;
-            client_slot.is_active.store(false);
-            for (auto i = 0; i < user_num.load(memory_order_relaxed); ++i) {
-                auto &slot = clients[i];
-                slot.then([&old_client](auto &cl) {
-                    if (is_near(cl.x, cl.y, old_client.x, old_client.y) &&
-                        cl.is_logged_in)
-                        send_remove_object_packet(cl, old_client);
+            deactivate_slot(client_slot);
+            for (auto near_id : old_client.copy_view_list()) {
+                with_client(near_id, [&old_client](auto &cl) {
+                    cl.erase_from_view(old_client.id);
+                    send_remove_object_packet(cl, old_client);
                 });
             }
         });
     } break;
+    case message_snapshot::type_num: {
+        auto round = ((message_snapshot *)(packet.get() +
+                                           sizeof(packet_header) +
+                                           sizeof(unsigned)))
+                         ->round;
+        with_client(id, [this, round](SOCKETINFO &cl) {
+            if (!cl.is_logged_in || cl.is_proxy || cl.name.empty())
+                return;
+            SnapshotEntity entity{};
+            memcpy(entity.name, cl.name.data(),
+                   min(cl.name.size(), size_t(MAX_ID_LEN - 1)));
+            const bool is_in_instance = cl.instance != nullptr;
+            entity.x = is_in_instance ? cl.world_x : cl.x;
+            entity.y = is_in_instance ? cl.world_y : cl.y;
+            entity.hp = cl.hp;
+            entity.level = cl.level;
+            entity.exp = cl.exp;
+            entity.saved_at = record_time();
+            world_snapshot.add(round, entity);
+        });
+    } break;
+    case message_save::type_num: {
+        with_client(id, [this](SOCKETINFO &cl) {
+            if (cl.is_logged_in && !cl.is_proxy)
+                save_player(cl);
+        });
+    } break;
+    case message_player_loaded::type_num: {
+        message_player_loaded *loaded =
+            (message_player_loaded *)(packet.get() + sizeof(packet_header) +
+                                      sizeof(unsigned));
+        with_client(id, [this, loaded](SOCKETINFO &cl) {
+            // The answer to an earlier client of the slot, or the login has
+            // been turned down meanwhile.
+            if (cl.is_logged_in ||
+                cl.name != string_view{loaded->name,
+                                       strnlen(loaded->name, MAX_ID_LEN)})
+                return;
+            optional<PlayerRecord> record;
+            if (loaded->is_found) {
+                record.emplace();
+                memcpy(record->name, loaded->name, MAX_ID_LEN);
+                record->x = loaded->x;
+                record->y = loaded->y;
+                record->hp = loaded->hp;
+                record->level = loaded->level;
+                record->exp = loaded->exp;
+            }
+            finish_login(cl, record);
+        });
+    } break;
+    case message_kick::type_num: {
+        with_client(id, [this](SOCKETINFO &cl) {
+            // Behind the login_ok and the views already sent to the client,
+            // so the front end turns it away only after they reached it.
+            send_packet<sf_packet_reject_login>(
+                cl,
+                [](sf_packet_reject_login &packet) {
+                    packet.reason = REJECT_NAME_TAKEN;
+                },
+                LinkWriter::Bulk);
+            disconnect(cl.id);
+        });
+    } break;
     default:
-        cerr << "Unknown type has been received" << endl;
+        LOG(LogWarn, "Unknown type has been received : ", int(packet[1]),
+            " for #", id);
     }
     return false;
 }
@@ -767,11 +2331,20 @@ bool Server::process_packet(int id, void *buff) {
     packet_header *header = (packet_header *)buff;
     unsigned char *packet =
         reinterpret_cast<unsigned char *>(buff) + sizeof(packet_header);
+    // What the client sent after the header, which may be less than the
+    // struct it is read as.
+    const size_t body_size = header->size > sizeof(packet_header)
+                                 ? header->size - sizeof(packet_header)
+                                 : 0;
     switch (header->type) {
     case cs_packet_login::type_num: {
         cs_packet_login *login_packet =
             reinterpret_cast<cs_packet_login *>(packet);
-        ProcessLogin(id, login_packet->id);
+        unsigned char features = 0;
+        if (header->size >= sizeof(packet_header) + sizeof(cs_packet_login) +
+                                sizeof(cs_login_features))
+            features = ((cs_login_features *)(login_packet + 1))->flags;
+        ProcessLogin(id, login_packet->id, features);
     } break;
     case cs_packet_move::type_num: {
         cs_packet_move *move_packet =
@@ -783,15 +2356,33 @@ bool Server::process_packet(int id, void *buff) {
     case cs_packet_chat::type_num: {
         cs_packet_chat *chat_packet =
             reinterpret_cast<cs_packet_chat *>(packet);
-        ProcessChat(id, chat_packet->chat_str);
+        ProcessChat(id, chat_packet->chat_str, body_size);
+    } break;
+    case cs_packet_shout::type_num: {
+        cs_packet_shout *shout_packet =
+            reinterpret_cast<cs_packet_shout *>(packet);
+        ProcessShout(id, shout_packet->chat_str, body_size);
     } break;
     case cs_packet_logout::type_num:
         break;
     case cs_packet_teleport::type_num:
         ProcessMove(id, 99, 0);
         break;
+    case cs_packet_compact_pos::type_num:
+        with_client(id, [](SOCKETINFO &cl) { enable_compact_pos(cl); });
+        break;
+    case cs_packet_enter_instance::type_num: {
+        auto enter_packet = (cs_packet_enter_instance *)packet;
+        bool result = false;
+        with_client(id, [this, enter_packet, &result](SOCKETINFO &cl) {
+            result = EnterInstance(cl, enter_packet->instance);
+        });
+        return result;
+    } break;
+
     default:
-        cerr << "Unknown type has been received" << endl;
+        LOG(LogWarn, "Unknown type has been received : ", int(header->type),
+            " from #", id);
     }
     return false;
 }
@@ -803,32 +2394,37 @@ void Server::process_packet_from_server(unsigned char *buff, size_t length) {
     switch (header->type) {
     case ss_packet_put::type_num: {
         ss_packet_put *put_packet = reinterpret_cast<ss_packet_put *>(packet);
-
-        auto &client_slot = clients[put_packet->id];
-        client_slot.then_else(
-            [](auto &cl) {},
-            [put_packet, &client_slot, this]() {
-                client_slot.ptr.reset(create_new_player(
-                    this->front_end_sock, put_packet->id, put_packet->x,
-                    put_packet->y, true, 1 - server_id));
-                client_slot.is_active.store(true, memory_order_release);
-                auto old_user_num = user_num.load(memory_order_relaxed);
-                if (old_user_num <= put_packet->id)
-                    user_num.fetch_add(put_packet->id - old_user_num + 1,
-                                       memory_order_relaxed);
-            });
-
-        auto msg = make_message<message_proxy_in>(
-            put_packet->id, [put_packet](message_proxy_in &msg) {
-                msg.x = put_packet->x;
-                msg.y = put_packet->y;
-            });
-        client_slot.ptr->pending_packets.emplace(move(msg));
+        const auto id = put_packet->id;
+
+        auto &client_slot = slot_of(id);
+        if (client_slot.holds(id)) {
+            auto msg = make_message<message_proxy_in>(
+                id, [put_packet](message_proxy_in &msg) {
+                    msg.x = put_packet->x;
+                    msg.y = put_packet->y;
+                });
+            client_slot.get()->pending_packets.emplace(move(msg));
+        } else if (!client_slot) {
+            optional<Position> old_pos;
+            if (is_ghost(id))
+                old_pos = Position{entities.x(id_index(id)),
+                                   entities.y(id_index(id))};
+            put_ghost(id, put_packet->x, put_packet->y);
+            update_ghost_view(id, old_pos,
+                              Position{put_packet->x, put_packet->y});
+        }
     } break;
     case ss_packet_leave::type_num: {
         ss_packet_leave *leave_packet = (ss_packet_leave *)packet;
-        auto &client_slot = clients[leave_packet->id];
-        client_slot.then([&client_slot](auto &old_client) {
+        const auto id = leave_packet->id;
+        if (is_ghost(id)) {
+            Position old_pos{entities.x(id_index(id)),
+                             entities.y(id_index(id))};
+            remove_ghost(id);
+            update_ghost_view(id, old_pos, nullopt);
+            break;
+        }
+        with_client(id, [](auto &old_client) {
             auto msg = make_message<message_proxy_leave>(old_client.id,
                                                          [](auto &_) {});
             old_client.pending_packets.emplace(move(msg));
@@ -836,8 +2432,16 @@ void Server::process_packet_from_server(unsigned char *buff, size_t length) {
     } break;
     case ss_packet_move::type_num: {
         ss_packet_move *move_packet = (ss_packet_move *)packet;
-        auto &client_slot = clients[move_packet->id];
-        client_slot.then([move_packet, this](auto &cl) {
+        const auto id = move_packet->id;
+        if (is_ghost(id)) {
+            const auto index = id_index(id);
+            Position old_pos{entities.x(index), entities.y(index)};
+            entities.set_position(index, move_packet->x, move_packet->y);
+            update_ghost_view(id, old_pos,
+                              Position{move_packet->x, move_packet->y});
+            break;
+        }
+        with_client(id, [move_packet](auto &cl) {
             auto msg = make_message<message_proxy_move>(
                 move_packet->id, [move_packet](message_proxy_move &msg) {
                     msg.x = move_packet->x;
@@ -846,39 +2450,167 @@ void Server::process_packet_from_server(unsigned char *buff, size_t length) {
             cl.pending_packets.emplace(move(msg));
         });
     } break;
-    case ss_packet_hand_over_started::type_num: {
-        ss_packet_hand_over_started *h_packet =
-            (ss_packet_hand_over_started *)packet;
-        clients[h_packet->id].then([h_packet](SOCKETINFO &cl) {
-            auto packet = make_message<message_hand_over_started>(
-                h_packet->id, [](auto &_) {});
-
-            cl.pending_packets.emplace(move(packet));
+    case ss_packet_hand_over_state::type_num: {
+        ss_packet_hand_over_state *s_packet =
+            (ss_packet_hand_over_state *)packet;
+        promote_ghost(this->front_end_link, s_packet->id, 1 - server_id);
+        with_client(s_packet->id, [s_packet](SOCKETINFO &cl) {
+            auto msg = make_message<message_hand_over_state>(
+                s_packet->id, [s_packet](message_hand_over_state &msg) {
+                    msg.x = s_packet->x;
+                    msg.y = s_packet->y;
+                    memcpy(msg.name, s_packet->name, MAX_ID_LEN);
+                    msg.hp = s_packet->hp;
+                    msg.level = s_packet->level;
+                    msg.exp = s_packet->exp;
+                    msg.hysteresis = s_packet->hysteresis;
+                    msg.is_compact_pos = s_packet->is_compact_pos;
+                    msg.pos_epoch = s_packet->pos_epoch;
+                    msg.is_area_snapshot = s_packet->is_area_snapshot;
+                });
+            cl.pending_packets.emplace(move(msg));
         });
     } break;
     case ss_packet_forwarding::type_num: {
+        // Same layout as the frame, only the type differs.
         ss_packet_forwarding *f_packet = (ss_packet_forwarding *)packet;
-        clients[f_packet->id].then([buff](SOCKETINFO &cl) {
-            unsigned char *real_packet =
-                (buff + sizeof(packet_header) + sizeof(ss_packet_forwarding));
-            unique_ptr<unsigned char[]> new_packet(
-                new unsigned char[real_packet[0]]);
-            memcpy(new_packet.get(), real_packet, real_packet[0]);
-            cl.pending_packets.emplace(move(new_packet));
+        with_client(f_packet->id, [buff, length](SOCKETINFO &cl) {
+            unique_ptr<unsigned char[]> msg(new unsigned char[length]);
+            memcpy(msg.get(), buff, length);
+            msg[1] = message_forwarded::type_num;
+            cl.pending_packets.emplace(move(msg));
+        });
+    } break;
+    case ss_packet_hand_over_view::type_num: {
+        ss_packet_hand_over_view *v_packet = (ss_packet_hand_over_view *)packet;
+        promote_ghost(this->front_end_link, v_packet->id, 1 - server_id);
+        with_client(v_packet->id, [buff, length](SOCKETINFO &cl) {
+            unique_ptr<unsigned char[]> msg(new unsigned char[length]);
+            memcpy(msg.get(), buff, length);
+            msg[1] = message_hand_over_view::type_num;
+            cl.pending_packets.emplace(move(msg));
         });
     } break;
     case ss_packet_hand_overed::type_num: {
         ss_packet_hand_overed *h_packet = (ss_packet_hand_overed *)packet;
-        send_packet_to_server<ss_packet_leave>(
-            this->other_server_send,
-            [h_packet](ss_packet_leave &packet) { packet.id = h_packet->id; });
-        clients[h_packet->id].then([h_packet](SOCKETINFO &cl) {
+        with_client(h_packet->id, [h_packet](SOCKETINFO &cl) {
             auto msg = make_message<message_hand_over_ended>(h_packet->id,
-                                                             [](auto &_) {});
+                                                             [](auto &) {});
+            cl.pending_packets.emplace(move(msg));
+        });
+    } break;
+    case ss_packet_name_claim::type_num: {
+        ss_packet_name_claim *claim_packet = (ss_packet_name_claim *)packet;
+        string_view name{claim_packet->name,
+                         strnlen(claim_packet->name, MAX_ID_LEN)};
+        auto holder = names.claim(name, claim_packet->id, 1 - server_id);
+        // Both servers see both claims, so the lower id always wins.
+        if (holder && holder->id != INVALID_ID &&
+            holder->server_id == server_id && claim_packet->id < holder->id) {
+            names.force_claim(name, claim_packet->id, 1 - server_id);
+            with_client(holder->id, [](SOCKETINFO &cl) {
+                auto msg = make_message<message_kick>(cl.id, [](auto &) {});
+                cl.pending_packets.emplace(move(msg));
+            });
+        }
+    } break;
+    case ss_packet_chat::type_num: {
+        ss_packet_chat *chat_packet = (ss_packet_chat *)packet;
+        broadcast_chat(chat_packet->id, chat_packet->chat,
+                       sizeof(chat_packet->chat));
+    } break;
+    case ss_packet_move_seam::type_num: {
+        ss_packet_move_seam *seam_packet = (ss_packet_move_seam *)packet;
+        if (move_seam(seam_packet->seam_y, seam_packet->version))
+            cerr << "Seam moved to " << seam_packet->seam_y
+                 << " by the other server" << endl;
+    } break;
+    case ss_packet_name_release::type_num: {
+        ss_packet_name_release *release_packet =
+            (ss_packet_name_release *)packet;
+        names.release(string_view{release_packet->name,
+                                  strnlen(release_packet->name, MAX_ID_LEN)},
+                      release_packet->id);
+    } break;
+    case ss_packet_logout::type_num: {
+        // Behind the leave disconnect sent if the client was in the edge.
+        const auto id = ((ss_packet_logout *)packet)->id;
+        if (is_ghost(id)) {
+            Position old_pos{entities.x(id_index(id)),
+                             entities.y(id_index(id))};
+            remove_ghost(id);
+            update_ghost_view(id, old_pos, nullopt);
+        }
+        auto &client_slot = slot_of(id);
+        if (client_slot.holds(id)) {
+            auto &proxy = *client_slot.get();
+            proxy.is_logged_out.store(true);
+            proxy.pending_packets.emplace(
+                make_message<message_proxy_leave>(id, [](auto &) {}));
+            // deactivate_slot answers once the proxy has left.
+            if (client_slot.is_active.load() && client_slot.get() == &proxy)
+                break;
+        }
+        send_packet<sf_packet_logout_done>(front_end_link, id,
+                                           [](sf_packet_logout_done &) {});
+    } break;
+    case ss_packet_player_save::type_num: {
+        ss_packet_player_save *save_packet = (ss_packet_player_save *)packet;
+        if (!player_db)
+            break;
+        PlayerRecord record;
+        memcpy(record.name, save_packet->name, MAX_ID_LEN);
+        record.name[MAX_ID_LEN - 1] = '\0';
+        record.x = save_packet->x;
+        record.y = save_packet->y;
+        record.hp = save_packet->hp;
+        record.level = save_packet->level;
+        record.exp = save_packet->exp;
+        record.saved_at = save_packet->saved_at;
+        if (save_packet->is_restored)
+            player_db->restore(record);
+        else
+            player_db->save(record);
+    } break;
+    case ss_packet_player_load::type_num: {
+        ss_packet_player_load *load_packet = (ss_packet_player_load *)packet;
+        if (!player_db)
+            break;
+        auto record = player_db->load(string{
+            load_packet->name, strnlen(load_packet->name, MAX_ID_LEN)});
+        send_packet_to_server<ss_packet_player_record>(
+            other_server_link,
+            [load_packet, &record](ss_packet_player_record &p) {
+                p.id = load_packet->id;
+                memcpy(p.name, load_packet->name, MAX_ID_LEN);
+                p.is_found = record.has_value();
+                if (!record)
+                    return;
+                p.x = record->x;
+                p.y = record->y;
+                p.hp = record->hp;
+                p.level = record->level;
+                p.exp = record->exp;
+            });
+    } break;
+    case ss_packet_player_record::type_num: {
+        ss_packet_player_record *r_packet = (ss_packet_player_record *)packet;
+        with_client(r_packet->id, [r_packet](SOCKETINFO &cl) {
+            auto msg = make_message<message_player_loaded>(
+                r_packet->id, [r_packet](message_player_loaded &msg) {
+                    memcpy(msg.name, r_packet->name, MAX_ID_LEN);
+                    msg.is_found = r_packet->is_found;
+                    msg.x = r_packet->x;
+                    msg.y = r_packet->y;
+                    msg.hp = r_packet->hp;
+                    msg.level = r_packet->level;
+                    msg.exp = r_packet->exp;
+                });
             cl.pending_packets.emplace(move(msg));
         });
     } break;
     default:
-        cerr << "Unknown type has been received" << endl;
+        LOG(LogWarn, "Unknown type has been received from the other server : ",
+            int(header->type));
     }
 }
@@ -1,10 +1,21 @@
 #ifndef A5F36F66_1CD6_49C1_9533_263A9B883FE0
 #define A5F36F66_1CD6_49C1_9533_263A9B883FE0
 
+#include "affinity.h"
+#include "db.h"
+#include "link_writer.h"
+#include "metrics.h"
 #include "mpsc_queue.h"
+#include "name_directory.h"
+#include "parker.h"
+#include "position_stream.h"
 #include "protocol.h"
 #include "spsc_queue.h"
+#include "world_instance.h"
+#include "world_snapshot.h"
 #include <boost/asio.hpp>
+#include <chrono>
+#include <climits>
 #include <iostream>
 #include <memory>
 #include <mutex>
@@ -18,39 +29,105 @@ using boost_error = boost::system::error_code;
 
 constexpr unsigned NUM_WORKER = 6;
 
+// The only server with a player db. Clients of the other one are saved to and
+// loaded from it over the link, so a player finds its last state whichever
+// server the front end logs it in to.
+constexpr unsigned DB_SERVER_ID = 0;
+
+struct ServerConfig {
+    unsigned id;
+    unsigned short accept_port;
+    unsigned short other_server_accept_port;
+    string db_path;
+    std::chrono::milliseconds db_commit_interval;
+    std::chrono::seconds db_save_interval;
+    size_t name_directory_capacity;
+    std::chrono::seconds metrics_interval;
+    short hysteresis_step;
+    short hysteresis_max;
+    std::chrono::milliseconds hysteresis_window;
+    WaitPolicy wait_policy;
+    string snapshot_path;
+    std::chrono::milliseconds snapshot_interval;
+    CpuList io_cpus;
+    CpuList scheduler_cpus;
+    vector<CpuList> worker_cpus;
+    std::chrono::milliseconds load_interval;
+    double shed_load;
+    double overload_load;
+    size_t max_backlog;
+    unsigned instance_count;
+    short instance_width;
+    short instance_height;
+    unsigned instance_capacity;
+};
+
+// Handover traffic goes ahead of the positions and chat staged on a link.
+// ss_packet_put only does when it opens a handover, see begin_hand_over.
+template <>
+inline constexpr LinkWriter::Lane lane_of<ss_packet_hand_over_view> =
+    LinkWriter::Control;
+template <>
+inline constexpr LinkWriter::Lane lane_of<ss_packet_hand_over_state> =
+    LinkWriter::Control;
+template <>
+inline constexpr LinkWriter::Lane lane_of<ss_packet_hand_overed> =
+    LinkWriter::Control;
+// The seam goes ahead of the handovers it starts.
+template <>
+inline constexpr LinkWriter::Lane lane_of<ss_packet_move_seam> =
+    LinkWriter::Control;
+// Saves and loads keep their order in the control lane, so a load is answered
+// after every save sent ahead of it and a handover state comes after the save
+// of its handover. A logout save also gets ahead of the name release behind
+// it, and the name stays taken until then.
+template <>
+inline constexpr LinkWriter::Lane lane_of<ss_packet_player_save> =
+    LinkWriter::Control;
+template <>
+inline constexpr LinkWriter::Lane lane_of<ss_packet_player_load> =
+    LinkWriter::Control;
+template <>
+inline constexpr LinkWriter::Lane lane_of<ss_packet_player_record> =
+    LinkWriter::Control;
+template <>
+inline constexpr LinkWriter::Lane lane_of<sf_packet_hand_over> =
+    LinkWriter::Control;
+template <>
+inline constexpr LinkWriter::Lane lane_of<sf_packet_reject_login> =
+    LinkWriter::Control;
+template <>
+inline constexpr LinkWriter::Lane lane_of<sf_packet_logout_done> =
+    LinkWriter::Control;
+
 template <typename F>
-void send_packet_to_server(tcp::socket &sock, unsigned packet_size,
-                           F &&packet_maker_func) {
+void send_packet_to_server(LinkWriter &link, unsigned packet_size,
+                           F &&packet_maker_func, LinkWriter::Lane lane) {
     if (packet_size <= 0)
         return;
 
-    unsigned char *packet = new unsigned char[packet_size];
+    unique_ptr<unsigned char[]> packet{new unsigned char[packet_size]};
 
-    packet_maker_func(packet);
+    packet_maker_func(packet.get());
 
-    sock.async_send(
-        buffer(packet, packet_size), [packet](auto error, auto length) {
-            delete[] packet;
-            if (error) {
-                std::cerr << "Error at send to server : " << error.message()
-                          << std::endl;
-            }
-        });
+    link.send(move(packet), packet_size, lane);
 }
 
 template <typename P, typename F>
-void send_packet_to_server(tcp::socket &sock, F &&packet_maker_func) {
+void send_packet_to_server(LinkWriter &link, F &&packet_maker_func,
+                           LinkWriter::Lane lane = lane_of<P>) {
     unsigned total_size = sizeof(packet_header) + sizeof(P);
 
     send_packet_to_server(
-        sock, total_size,
+        link, total_size,
         [f{move(packet_maker_func)}, total_size](unsigned char *packet) {
             packet_header *header = (packet_header *)packet;
             header->size = total_size;
             header->type = P::type_num;
 
             f(*(P *)(packet + sizeof(packet_header)));
-        });
+        },
+        lane);
 }
 
 struct ViewEvent {
@@ -60,26 +137,109 @@ struct ViewEvent {
 
 enum ClientStatus { Normal, HandOvering, HandOvered };
 
+// Shedding drops chat, Overloaded also turns new logins away. Moves are
+// never dropped.
+enum LoadLevel { LoadNormal, LoadShedding, LoadOverloaded };
+
+enum MoveType { None, EnterToEdge, LeaveFromBuffer, HandOver };
+
+// A run of queued moves walked from where the client stands. It stops at the
+// step that hands the client over, so the rest of it goes to the new owner
+// like any input after the decision.
+struct MoveRun {
+    short x, y;
+    size_t applied;
+    // Where the last step started, its seam checks start from there.
+    short last_from_y;
+    // HandOver if a step handed over, else what the whole run does.
+    MoveType type;
+};
+
+MoveRun walk_moves(short x, short y, const vector<cs_packet_move *> &moves,
+                   unsigned server_id, short extra);
+
+// State only a client in the middle of a handover needs. Most clients never
+// hand over, so it is taken from a pool on first use and given back when the
+// client goes away.
+struct HandOverState {
+    MPSCQueue<unique_ptr<unsigned char[]>> pending_packets;
+    // What the client saw on the previous owner, only touched by workers.
+    set<unsigned> view;
+    std::chrono::steady_clock::time_point started_at;
+    atomic<std::chrono::steady_clock::rep> stall_started_at{0};
+};
+
+HandOverState *acquire_hand_over_state();
+void release_hand_over_state(HandOverState *state);
+
 struct SOCKETINFO {
     unsigned id;
-    tcp::socket &sock;
+    LinkWriter &link;
     string name;
 
     bool is_proxy;
     bool is_logged_in{false};
     short x, y;
+    short hp{100};
+    short level{1};
+    int exp{1};
     int move_time{0};
     bool is_in_edge;
+    // Extra tiles the client must travel past the seam bands, grown by
+    // handovers in quick succession.
+    short hysteresis{0};
+    std::chrono::steady_clock::time_point last_crossed_at;
     atomic<ClientStatus> status{Normal};
 
     MPSCQueue<unique_ptr<unsigned char[]>> pending_packets;
-    MPSCQueue<unique_ptr<unsigned char[]>> pending_while_hand_over_packets;
     atomic_bool is_handling{false};
 
-    SOCKETINFO(unsigned id, tcp::socket &sock, bool is_proxy, short x, short y,
+    // Only set once the client asks for compact positions.
+    atomic<PositionStream *> position_stream{nullptr};
+    // Only touched by the jobs of this client.
+    bool is_area_snapshot{false};
+
+    // Set while the client is in an instance, only touched by its jobs.
+    WorldInstance *instance{nullptr};
+    unsigned instance_row{0};
+    // Where it left the seamless world, to come back to and to be saved at.
+    short world_x{0}, world_y{0};
+    // Set when a moved seam hands it over, until the fence of the handover.
+    bool is_migrating{false};
+    // Steps since the view was last rebuilt from a full scan, only touched
+    // by its jobs.
+    unsigned view_steps{0};
+    // Set on a proxy once the owner has logged the client out, the front end
+    // gets sf_packet_logout_done for it when it leaves its slot.
+    atomic_bool is_logged_out{false};
+
+    SOCKETINFO(unsigned id, LinkWriter &link, bool is_proxy, short x, short y,
                bool is_in_edge)
-        : id{id}, sock{sock}, is_proxy{is_proxy}, x{x}, y{y}, is_in_edge{
+        : id{id}, link{link}, is_proxy{is_proxy}, x{x}, y{y}, is_in_edge{
                                                                   is_in_edge} {}
+    ~SOCKETINFO() {
+        delete position_stream.load();
+        if (auto state = hand_over_state.load())
+            release_hand_over_state(state);
+    }
+
+    // Io threads and workers may both be the first to need it.
+    HandOverState &hand_over() {
+        auto state = hand_over_state.load(memory_order_acquire);
+        if (state != nullptr)
+            return *state;
+        auto fresh = acquire_hand_over_state();
+        if (hand_over_state.compare_exchange_strong(state, fresh,
+                                                    memory_order_acq_rel))
+            return *fresh;
+        release_hand_over_state(fresh);
+        return *state;
+    }
+    bool has_hand_over_packets() const {
+        auto state = hand_over_state.load(memory_order_acquire);
+        return state != nullptr && !state->pending_packets.is_empty();
+    }
+
     void insert_to_view(unsigned id) {
         unique_lock<mutex> lg{view_list_lock, try_to_lock};
         if (lg) {
@@ -103,36 +263,67 @@ struct SOCKETINFO {
         update_view_from_msg();
         return view_list;
     }
+    void replace_view(set<unsigned> new_view_list) {
+        unique_lock<mutex> lg{view_list_lock};
+        update_view_from_msg();
+        view_list = move(new_view_list);
+    }
 
-    void end_hand_over(tcp::socket &send_sock) {
-        auto maker = [this, &send_sock](unique_ptr<unsigned char[]> packet) {
-            unsigned total_size = sizeof(ss_packet_forwarding) +
-                                  sizeof(packet_header) + packet[0];
-            send_packet_to_server(
-                send_sock, total_size,
-                [this, total_size, &packet](unsigned char *p) {
-                    packet_header *header = (packet_header *)p;
-                    header->size = total_size;
-                    header->type = ss_packet_forwarding::type_num;
-
-                    p += sizeof(packet_header);
-                    ss_packet_forwarding *outer_packet =
-                        (ss_packet_forwarding *)p;
-                    outer_packet->id = id;
-
-                    p += sizeof(ss_packet_forwarding);
+    // Forwards every input that reached this server after the handover
+    // decision, packed into as few ss_packet_forwarding frames as fit, and
+    // the end marker, with a single send.
+    void end_hand_over(LinkWriter &send_link) {
+        constexpr unsigned frame_header_size =
+            sizeof(packet_header) + sizeof(ss_packet_forwarding);
+
+        vector<unique_ptr<unsigned char[]>> packets;
+        this->hand_over().pending_packets.for_each(
+            [&packets](unique_ptr<unsigned char[]> packet) {
+                packets.emplace_back(move(packet));
+            });
+
+        unsigned total_size =
+            sizeof(packet_header) + sizeof(ss_packet_hand_overed);
+        unsigned frame_size = 0;
+        for (auto &packet : packets) {
+            if (frame_size == 0 || frame_size + packet[0] > UCHAR_MAX) {
+                total_size += frame_header_size;
+                frame_size = frame_header_size;
+            }
+            frame_size += packet[0];
+            total_size += packet[0];
+        }
+
+        send_packet_to_server(
+            send_link, total_size, [this, &packets](unsigned char *p) {
+                packet_header *frame = nullptr;
+                for (auto &packet : packets) {
+                    if (frame == nullptr ||
+                        frame->size + packet[0] > UCHAR_MAX) {
+                        frame = (packet_header *)p;
+                        frame->size = frame_header_size;
+                        frame->type = ss_packet_forwarding::type_num;
+                        ((ss_packet_forwarding *)(frame + 1))->id = id;
+                        p += frame_header_size;
+                    }
                     memcpy(p, packet.get(), packet[0]);
-                });
-        };
-        this->pending_while_hand_over_packets.for_each(maker);
-        this->pending_packets.for_each(maker);
-        send_packet_to_server<ss_packet_hand_overed>(
-            send_sock,
-            [this](ss_packet_hand_overed &packet) { packet.id = id; });
+                    p += packet[0];
+                    frame->size += packet[0];
+                }
+
+                packet_header *header = (packet_header *)p;
+                header->size =
+                    sizeof(packet_header) + sizeof(ss_packet_hand_overed);
+                header->type = ss_packet_hand_overed::type_num;
+                ((ss_packet_hand_overed *)(header + 1))->id = id;
+            },
+            LinkWriter::Control);
         this->status.store(Normal, std::memory_order_release);
     }
 
   private:
+    atomic<HandOverState *> hand_over_state{nullptr};
+
     set<unsigned> view_list;
     mutex view_list_lock;
     MPSCQueue<ViewEvent> view_msg_queue;
@@ -155,19 +346,25 @@ struct SOCKETINFO {
 
 struct ClientSlot {
     atomic_bool is_active;
-    unique_ptr<SOCKETINFO> ptr;
+    // Replaced by activate_slot while other threads read it, the one it
+    // replaces is retired, see retire_client.
+    atomic<SOCKETINFO *> ptr{nullptr};
+
+    ~ClientSlot() { delete ptr.load(); }
 
     operator bool() const { return is_active.load(memory_order_acquire); }
+    SOCKETINFO *get() const { return ptr.load(memory_order_acquire); }
+    bool holds(unsigned id) const { return *this && get()->id == id; }
 
     template <typename F> auto then(F &&func) {
         if (*this) {
-            return func(*(this->ptr));
+            return func(*get());
         }
     }
 
     template <typename F, typename F2> auto then_else(F &&func, F2 &&func2) {
         if (*this) {
-            return func(*(this->ptr));
+            return func(*get());
         } else {
             return func2();
         }
@@ -190,13 +387,37 @@ class Server {
     void process_packet_from_server(unsigned char *buff, size_t length);
     void do_worker(unsigned worker_id);
     void acquire_new_id(unsigned new_id);
-    void ProcessLogin(int user_id, char *id_str);
-    void ProcessChat(int id, char *mess);
+    void ProcessLogin(int user_id, char *id_str, unsigned char features);
+    void finish_login(SOCKETINFO &client,
+                      const optional<PlayerRecord> &record);
+    void ProcessChat(int id, const char *mess, size_t size);
+    void ProcessShout(int id, const char *mess, size_t size);
+    void broadcast_chat(int teller, const char *mess, size_t size);
     bool ProcessMove(int id, unsigned char dir, unsigned move_time);
-    bool ProcessMove(SOCKETINFO &cl, short new_x, short new_y,
-                     unsigned move_time);
+    bool ProcessMove(SOCKETINFO &cl, short new_x, short new_y, short from_y,
+                     MoveType move_type);
+    pair<size_t, bool> ProcessMoves(SOCKETINFO &cl,
+                                    const vector<cs_packet_move *> &moves);
+    void ProcessInstanceMove(SOCKETINFO &cl, unsigned char dir);
+    void decay_hysteresis(SOCKETINFO &cl);
+    bool EnterInstance(SOCKETINFO &cl, int instance_id);
 
     void disconnect(unsigned id);
+    void save_player(SOCKETINFO &cl);
+    void store_player(const PlayerRecord &record, bool is_restored);
+    void begin_hand_over(SOCKETINFO &cl);
+    void reject_login(ClientSlot &slot);
+    vector<unsigned> near_of(SOCKETINFO &cl);
+    void leave_area(SOCKETINFO &cl);
+    void enter_area(SOCKETINFO &cl, const set<unsigned> &old_view,
+                    bool is_known);
+    void take_snapshot();
+    void restore_snapshot();
+    void update_load();
+    void run_console();
+    unsigned next_seam_version();
+    bool move_seam(short y, unsigned version);
+    void wake_master();
 
     unsigned server_id;
     io_context context;
@@ -205,8 +426,67 @@ class Server {
     tcp::socket other_server_recv;
     tcp::socket other_server_send;
     tcp::socket front_end_sock;
+    LinkWriter other_server_link{other_server_send};
+    LinkWriter front_end_link{front_end_sock};
 
     array<SPSCQueue<unsigned>, NUM_WORKER> worker_queue;
+    array<Parker, NUM_WORKER> worker_parkers;
+    Parker master_parker;
+    // Set with every notify of the master and cleared before each of its
+    // scans, so a spinning master polls one flag rather than every client.
+    atomic_bool has_pending_work{false};
+    WaitPolicy wait_policy;
+    CpuList io_cpus;
+    CpuList scheduler_cpus;
+    vector<CpuList> worker_cpus;
+
+    // Time each worker spent on jobs, only written by that worker.
+    array<atomic<uint64_t>, NUM_WORKER> worker_busy_ns{};
+    uint64_t last_busy_ns{0};
+    std::chrono::steady_clock::time_point last_load_time;
+    // Smoothed max of the worker busy ratio and backlog / max_backlog.
+    double load{0};
+    atomic<LoadLevel> load_level{LoadNormal};
+    std::chrono::milliseconds load_interval;
+    double shed_load;
+    double overload_load;
+    size_t max_backlog;
+
+    // Only on DB_SERVER_ID.
+    unique_ptr<PlayerDB> player_db;
+    // Rows restored from the snapshot of a server without the db, sent to
+    // DB_SERVER_ID once the link to it is up.
+    vector<PlayerRecord> restored_records;
+    std::chrono::seconds db_save_interval;
+    NameDirectory names;
+    WorldSnapshot world_snapshot;
+    std::chrono::milliseconds snapshot_interval;
+    vector<unique_ptr<WorldInstance>> instances;
+
+    short hysteresis_step;
+    short hysteresis_max;
+    std::chrono::milliseconds hysteresis_window;
+
+    std::chrono::seconds metrics_interval;
+    Histogram hand_over_latency{"hand_over_latency"};
+    Histogram hand_over_stall{"hand_over_stall"};
+    Histogram worker_wake_latency{"worker_wake_latency"};
+    Histogram snapshot_build{"snapshot_build"};
+    Counter hand_overs{"hand_overs"};
+    Counter hand_overs_avoided{"hand_overs_avoided"};
+    Counter edge_leaves_avoided{"edge_leaves_avoided"};
+    Counter logins_shed{"logins_shed"};
+    Counter chats_shed{"chats_shed"};
+    Counter shouts{"shouts"};
+    Counter instance_transfers{"instance_transfers"};
+    // From the seam moving to the fence of each client it handed over.
+    Histogram region_migration{"region_migration"};
+    Counter region_migrated{"region_migrated"};
+    atomic<std::chrono::steady_clock::rep> seam_moved_at{0};
+    // Count of moves times two plus the server the last one was made on,
+    // so moves made on both servers at once settle on the same seam.
+    unsigned seam_version{0};
+    mutex seam_lock;
 
     unsigned char recv_buf[MAX_BUFFER];
     size_t prev_packet_len;
@@ -215,8 +495,7 @@ class Server {
     size_t other_prev_len{0};
 
   public:
-    Server(unsigned id, unsigned short accept_port,
-           unsigned short other_server_accept_port);
+    Server(const ServerConfig &config);
     void run(const string &other_server_ip, unsigned short other_server_port);
 };
 #endif /* A5F36F66_1CD6_49C1_9533_263A9B883FE0 */
@@ -0,0 +1,69 @@
+#include "../server.h"
+#include <iostream>
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(expr)                                                            \
+    do {                                                                       \
+        if (!(expr)) {                                                         \
+            cerr << __FILE__ << ":" << __LINE__ << ": " #expr << endl;        \
+            ++failures;                                                        \
+        }                                                                      \
+    } while (false)
+
+struct Moves {
+    Moves(unsigned char dir, size_t count) : packets(count) {
+        for (auto &packet : packets) {
+            packet.direction = dir;
+            packet.move_time = 0;
+            moves.emplace_back(&packet);
+        }
+    }
+
+    vector<cs_packet_move> packets;
+    vector<cs_packet_move *> moves;
+};
+
+// The seam starts at WORLD_HEIGHT / 2, the edge band of server 0 at row 396
+// and its handover line past row 405.
+int main() {
+    {
+        // Crosses the edge line and the handover line in one batch.
+        Moves down{D_DOWN, 20};
+        auto run = walk_moves(12, 390, down.moves, 0, 0);
+        CHECK(run.type == HandOver);
+        CHECK(run.applied == 16);
+        CHECK(run.y == 406);
+        CHECK(run.last_from_y == 405);
+    }
+    {
+        // Widened bands move the handover line with them.
+        Moves down{D_DOWN, 20};
+        auto run = walk_moves(12, 390, down.moves, 0, 2);
+        CHECK(run.type == HandOver);
+        CHECK(run.applied == 18);
+        CHECK(run.y == 408);
+    }
+    {
+        // Stops short of the handover line, so it only enters the edge.
+        Moves down{D_DOWN, 9};
+        auto run = walk_moves(12, 390, down.moves, 0, 0);
+        CHECK(run.type == EnterToEdge);
+        CHECK(run.applied == 9);
+        CHECK(run.y == 399);
+    }
+    {
+        // The same on server 1, heading up.
+        Moves up{D_UP, 20};
+        auto run = walk_moves(12, 410, up.moves, 1, 0);
+        CHECK(run.type == HandOver);
+        CHECK(run.applied == 17);
+        CHECK(run.y == 393);
+    }
+
+    if (failures != 0)
+        cerr << failures << " checks failed" << endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+#include "../db.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sys/stat.h>
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(expr)                                                            \
+    do {                                                                       \
+        if (!(expr)) {                                                         \
+            cerr << __FILE__ << ":" << __LINE__ << ": " #expr << endl;        \
+            ++failures;                                                        \
+        }                                                                      \
+    } while (false)
+
+static const string PATH = "player_db_test.db";
+
+static PlayerRecord make_record(const char *name, short x, int exp) {
+    PlayerRecord record{};
+    strncpy(record.name, name, MAX_ID_LEN - 1);
+    record.x = x;
+    record.y = 1;
+    record.hp = 100;
+    record.level = 1;
+    record.exp = exp;
+    return record;
+}
+
+static off_t log_size() {
+    struct stat st;
+    return stat(PATH.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+int main() {
+    remove(PATH.c_str());
+    {
+        // A crash in the middle of the first record leaves part of it
+        // behind, with nothing to compact the log when it is opened.
+        auto record = make_record("torn", 3, 7);
+        ofstream out{PATH, ios::binary};
+        out.write((const char *)&record, sizeof(record) / 2);
+    }
+    {
+        PlayerDB db{PATH, 1ms};
+        db.save(make_record("after", 5, 9));
+    }
+    {
+        PlayerDB db{PATH, 1ms};
+        auto after = db.load("after");
+        CHECK(!db.load("torn"));
+        CHECK(after && after->x == 5 && after->exp == 9);
+    }
+    CHECK(log_size() % sizeof(PlayerRecord) == 0);
+
+    {
+        // Compacted while running, not only when opened.
+        PlayerDB db{PATH, 1ms};
+        for (int i = 0; i < 20000; ++i) {
+            db.save(make_record("a", 1, i));
+            db.save(make_record("b", 2, i));
+        }
+        this_thread::sleep_for(200ms);
+        CHECK(log_size() < off_t(4096 * sizeof(PlayerRecord)));
+    }
+    {
+        PlayerDB db{PATH, 1ms};
+        auto a = db.load("a");
+        auto b = db.load("b");
+        CHECK(a && a->exp == 19999);
+        CHECK(b && b->exp == 19999);
+        CHECK(db.load("after"));
+
+        // A snapshot row older than the last save does not replace it.
+        auto saved = make_record("c", 8, 2);
+        saved.saved_at = 200;
+        db.save(saved);
+        auto restored = make_record("c", 4, 1);
+        restored.saved_at = 100;
+        db.restore(restored);
+        CHECK(db.load("c")->x == 8);
+        restored.saved_at = 300;
+        db.restore(restored);
+        CHECK(db.load("c")->x == 4);
+    }
+    remove(PATH.c_str());
+
+    if (failures != 0)
+        cerr << failures << " checks failed" << endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+#include "world_instance.h"
+
+using namespace std;
+
+WorldInstance::WorldInstance(unsigned id, short width, short height,
+                             unsigned capacity)
+    : id_{id}, width_{width}, height_{height}, entities{capacity} {}
+
+optional<unsigned> WorldInstance::join(unsigned client_id, short x, short y) {
+    unsigned row;
+    {
+        lock_guard<mutex> lg{rows_lock};
+        if (!free_rows.empty()) {
+            row = free_rows.back();
+            free_rows.pop_back();
+        } else if (bound.load(memory_order_relaxed) < entities.capacity()) {
+            // Scans skip it until the flags below are set.
+            row = bound.load(memory_order_relaxed);
+            bound.store(row + 1, memory_order_release);
+        } else {
+            return nullopt;
+        }
+    }
+    entities.set_id(row, client_id);
+    entities.set_position(row, x, y);
+    entities.set_flags(row, ENTITY_ACTIVE | ENTITY_LOGGED_IN);
+    population_.fetch_add(1, memory_order_relaxed);
+    return row;
+}
+
+void WorldInstance::leave(unsigned row) {
+    entities.set_flags(row, 0);
+    population_.fetch_sub(1, memory_order_relaxed);
+    lock_guard<mutex> lg{rows_lock};
+    free_rows.emplace_back(row);
+}
+
+vector<unsigned> WorldInstance::find_near(short x, short y,
+                                          short range) const {
+    vector<unsigned> near_ids;
+    entities.query_near(x, y, range, ENTITY_ACTIVE | ENTITY_LOGGED_IN,
+                        bound.load(memory_order_acquire), near_ids);
+    return near_ids;
+}
+
+vector<unsigned> WorldInstance::members() const {
+    vector<unsigned> ids;
+    entities.query_rect(0, width_ - 1, 0, height_ - 1,
+                        ENTITY_ACTIVE | ENTITY_LOGGED_IN,
+                        bound.load(memory_order_acquire), ids);
+    return ids;
+}
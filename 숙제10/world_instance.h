@@ -0,0 +1,52 @@
+#ifndef E27B4C90_5D13_4A8F_B6E1_0C9A3F7D2B58
+#define E27B4C90_5D13_4A8F_B6E1_0C9A3F7D2B58
+
+#include "entity_table.h"
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// A small area hosted whole by one server, like a dungeon or an arena.
+// It has its own entity table, so its clients only ever find each other,
+// while the workers and the front end link are shared with the seamless
+// world. A client in it holds a row of the table, handed out on join.
+class WorldInstance {
+  public:
+    WorldInstance(unsigned id, short width, short height, unsigned capacity);
+    WorldInstance(const WorldInstance &) = delete;
+    WorldInstance(WorldInstance &&) = delete;
+
+    unsigned id() const { return id_; }
+    short width() const { return width_; }
+    short height() const { return height_; }
+    unsigned population() const {
+        return population_.load(std::memory_order_relaxed);
+    }
+
+    // Returns the row of the client, nullopt when the instance is full.
+    std::optional<unsigned> join(unsigned client_id, short x, short y);
+    void leave(unsigned row);
+    void set_position(unsigned row, short x, short y) {
+        entities.set_position(row, x, y);
+    }
+
+    // Ids of every client in the view range of (x, y).
+    std::vector<unsigned> find_near(short x, short y, short range) const;
+    // Ids of every client in it.
+    std::vector<unsigned> members() const;
+
+  private:
+    const unsigned id_;
+    const short width_;
+    const short height_;
+    EntityTable entities;
+
+    std::mutex rows_lock;
+    std::vector<unsigned> free_rows;
+    // Rows below it have been handed out at least once.
+    std::atomic_uint bound{0};
+    std::atomic_uint population_{0};
+};
+
+#endif /* E27B4C90_5D13_4A8F_B6E1_0C9A3F7D2B58 */
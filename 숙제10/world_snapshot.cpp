@@ -0,0 +1,146 @@
+#include "world_snapshot.h"
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static uint64_t checksum_of(const void *data, size_t size) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    auto p = (const unsigned char *)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+WorldSnapshot::WorldSnapshot(const string &path, size_t capacity)
+    : path{path}, capacity{capacity} {
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        throw runtime_error("Can't open world snapshot : " + path);
+
+    mapped_size = sizeof(Header) + 2 * capacity * sizeof(SnapshotEntity);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) != mapped_size) {
+        // Written with another capacity, or new. load() rejects it by the
+        // header.
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, mapped_size) != 0)
+            throw runtime_error("Can't resize world snapshot : " + path);
+    }
+
+    mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+    if (mapped == MAP_FAILED)
+        throw runtime_error("Can't map world snapshot : " + path);
+    header = (Header *)mapped;
+
+    writer = thread{[this]() { do_writer(); }};
+}
+
+WorldSnapshot::~WorldSnapshot() {
+    is_running.store(false, memory_order_release);
+    round_cv.notify_all();
+    if (writer.joinable())
+        writer.join();
+    if (mapped != nullptr && mapped != MAP_FAILED)
+        munmap(mapped, mapped_size);
+    if (fd >= 0)
+        close(fd);
+}
+
+SnapshotEntity *WorldSnapshot::half(uint32_t index) const {
+    return (SnapshotEntity *)((char *)mapped + sizeof(Header)) +
+           index * capacity;
+}
+
+vector<SnapshotEntity> WorldSnapshot::load() const {
+    if (header->magic != MAGIC || header->version != VERSION ||
+        header->capacity != capacity || header->active > 1)
+        return {};
+    const auto active = header->active;
+    const auto count = header->count[active];
+    if (count > capacity)
+        return {};
+    const auto entities = half(active);
+    if (checksum_of(entities, count * sizeof(SnapshotEntity)) !=
+        header->checksum[active])
+        return {};
+    return vector<SnapshotEntity>(entities, entities + count);
+}
+
+unsigned WorldSnapshot::next_round() {
+    unsigned next;
+    {
+        lock_guard<mutex> lg{round_lock};
+        closed_round = open_round;
+        next = ++open_round;
+    }
+    round_cv.notify_one();
+    return next;
+}
+
+void WorldSnapshot::add(unsigned round, const SnapshotEntity &entity) {
+    rows.emplace(round, entity);
+}
+
+void WorldSnapshot::write(const vector<SnapshotEntity> &entities) {
+    const bool is_valid = header->magic == MAGIC &&
+                          header->version == VERSION &&
+                          header->capacity == capacity && header->active <= 1;
+    const uint32_t target = is_valid ? 1 - header->active : 0;
+    const size_t count = min(entities.size(), capacity);
+    const size_t size = count * sizeof(SnapshotEntity);
+
+    auto dest = half(target);
+    memcpy(dest, entities.data(), size);
+    header->count[target] = count;
+    header->checksum[target] = checksum_of(dest, size);
+    msync(mapped, mapped_size, MS_SYNC);
+
+    header->magic = MAGIC;
+    header->version = VERSION;
+    header->capacity = capacity;
+    header->sequence += 1;
+    header->active = target;
+    msync(mapped, sizeof(Header), MS_SYNC);
+}
+
+void WorldSnapshot::do_writer() {
+    unsigned written_round = 0;
+    vector<SnapshotEntity> entities;
+    vector<pair<unsigned, SnapshotEntity>> early;
+    while (true) {
+        unsigned target;
+        {
+            unique_lock<mutex> lg{round_lock};
+            round_cv.wait(lg, [this, written_round]() {
+                return closed_round != written_round ||
+                       !is_running.load(memory_order_acquire);
+            });
+            if (closed_round == written_round)
+                return;
+            target = written_round = closed_round;
+        }
+
+        entities.clear();
+        auto take = [&entities, &early, target](auto row) {
+            if (row.first == target)
+                entities.emplace_back(row.second);
+            else if (row.first > target)
+                early.emplace_back(row);
+        };
+        auto kept = move(early);
+        early.clear();
+        for (auto &row : kept)
+            take(row);
+        rows.for_each(take);
+        write(entities);
+    }
+}
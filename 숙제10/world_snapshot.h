@@ -0,0 +1,85 @@
+#ifndef C6E2F0A4_91B3_4D7C_8A25_3F6B0D9E1C47
+#define C6E2F0A4_91B3_4D7C_8A25_3F6B0D9E1C47
+
+#include "mpsc_queue.h"
+#include "protocol.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#pragma pack(push, 1)
+// A player owned by the server, as its own job last saw it. Sessions do
+// not survive a restart, so ids, proxies, ghosts and the edge are left out,
+// a player logging in again gets them anew.
+struct SnapshotEntity {
+    char name[MAX_ID_LEN];
+    short x, y;
+    short hp;
+    short level;
+    int exp;
+    // See record_time.
+    int64_t saved_at;
+};
+#pragma pack(pop)
+
+// Player state kept in a memory mapped file with two halves.
+// The rows of a snapshot come from the jobs of the clients, each tagged
+// with the round it was asked for in. Opening a round hands the rows of the
+// one before to a writer thread, which copies them into the half the header
+// does not point at and only then publishes it by flipping the header, so a
+// crash in the middle of a write leaves the previous snapshot readable.
+// A row that comes after its round was written is dropped.
+class WorldSnapshot {
+  public:
+    WorldSnapshot(const std::string &path, size_t capacity);
+    ~WorldSnapshot();
+    WorldSnapshot(const WorldSnapshot &) = delete;
+    WorldSnapshot(WorldSnapshot &&) = delete;
+
+    // Entities of the last published snapshot. Empty when there is none or
+    // it does not validate.
+    std::vector<SnapshotEntity> load() const;
+    // Returns the round rows are now asked for in.
+    unsigned next_round();
+    void add(unsigned round, const SnapshotEntity &entity);
+
+  private:
+    struct Header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t capacity;
+        uint64_t sequence;
+        uint32_t active;
+        uint32_t count[2];
+        uint64_t checksum[2];
+    };
+
+    static constexpr uint64_t MAGIC = 0x534E50534C4D4553; // "SEMLSPNS"
+    static constexpr uint32_t VERSION = 3;
+
+    SnapshotEntity *half(uint32_t index) const;
+    void write(const std::vector<SnapshotEntity> &entities);
+    void do_writer();
+
+    std::string path;
+    const size_t capacity;
+    int fd{-1};
+    size_t mapped_size{0};
+    void *mapped{nullptr};
+    Header *header{nullptr};
+
+    MPSCQueue<std::pair<unsigned, SnapshotEntity>> rows;
+    unsigned open_round{0};
+    unsigned closed_round{0};
+    std::mutex round_lock;
+    std::condition_variable round_cv;
+    std::atomic_bool is_running{true};
+    std::thread writer;
+};
+
+#endif /* C6E2F0A4_91B3_4D7C_8A25_3F6B0D9E1C47 */